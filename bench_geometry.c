@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "geometry.h"
+#include "jbod.h"
+#include "util.h"
+
+/* Times the address decoding of geometry.h against the constant decoding
+ * it replaced: every logical block of the array is split into a disk and a
+ * block, linearly and striped, and packed into a read op. Run it with no
+ * arguments for the default geometry or with the number of disks and of
+ * blocks per disk for another one; the constant loops always decode with
+ * the default geometry's constants and serve as the baseline. mdadm picks
+ * that constant decoding once at mount for the default geometry, so there
+ * the constant lines are what the array pays and the geometry lines what
+ * any other geometry pays. */
+
+#define BENCH_ROUNDS 25000
+
+/* keeps the compiler from dropping the loops */
+volatile uint32_t bench_sink;
+
+static double seconds_since(uint64_t start) {
+  return (clock_ns() - start) / 1e9;
+}
+
+static void bench_constant(uint32_t num_blocks) {
+  uint32_t acc = 0;
+  uint64_t start = clock_ns();
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    for (uint32_t l = 0; l < num_blocks; l++) {
+      uint32_t disk = l / JBOD_NUM_BLOCKS_PER_DISK, block = l % JBOD_NUM_BLOCKS_PER_DISK;
+      acc += (JBOD_READ_BLOCK << 12) | (disk << 8) | block;
+    }
+  }
+  bench_sink = acc;
+  printf("constant linear  %.3f s\n", seconds_since(start));
+
+  acc = 0;
+  start = clock_ns();
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    for (uint32_t l = 0; l < num_blocks; l++) {
+      uint32_t disk = l % JBOD_NUM_DISKS, block = l / JBOD_NUM_DISKS;
+      acc += (JBOD_READ_BLOCK << 12) | (disk << 8) | block;
+    }
+  }
+  bench_sink = acc;
+  printf("constant striped %.3f s\n", seconds_since(start));
+}
+
+static void bench_geometry(uint32_t num_blocks) {
+  uint32_t acc = 0;
+  uint64_t start = clock_ns();
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    for (uint32_t l = 0; l < num_blocks; l++) {
+      uint32_t block, disk = geom_div_blocks(l, &block);
+      acc += geom_encode_op(JBOD_READ_BLOCK, disk, block);
+    }
+  }
+  bench_sink = acc;
+  printf("geometry linear  %.3f s\n", seconds_since(start));
+
+  acc = 0;
+  start = clock_ns();
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    for (uint32_t l = 0; l < num_blocks; l++) {
+      uint32_t disk, block = geom_div_disks(l, &disk);
+      acc += geom_encode_op(JBOD_READ_BLOCK, disk, block);
+    }
+  }
+  bench_sink = acc;
+  printf("geometry striped %.3f s\n", seconds_since(start));
+}
+
+int main(int argc, char *argv[]) {
+  if (argc == 3 && geometry_set(atoi(argv[1]), atoi(argv[2])) != 1) {
+    fprintf(stderr, "Invalid geometry %s,%s, aborting.\n", argv[1], argv[2]);
+    return -1;
+  }
+  printf("%d disks of %d blocks, %d rounds over the array\n",
+         geometry.num_disks, geometry.blocks_per_disk, BENCH_ROUNDS);
+  // both loops run over a count known only at run time, like the callers'
+  bench_constant(geometry.num_blocks);
+  bench_geometry(geometry.num_blocks);
+  return 0;
+}
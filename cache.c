@@ -5,110 +5,285 @@
 #include <assert.h>
 
 #include "cache.h"
+#include "geometry.h"
 #include "jbod.h"
+#include "vcache.h"
 
 static cache_entry_t *cache = NULL;
+static cache_payload_t *payloads = NULL;
 static int cache_size = 0;
+static int num_payloads = 0;
 static int num_queries = 0;
 static int num_hits = 0;
+static int num_stores = 0;
+static int num_shared_stores = 0;
+static int num_valid = 0;
+static int peak_valid = 0;
+static uint64_t hit_ns = 0;
+
+/* the entry of every block of the array, or -1; indexed like the geometry
+ * lays out op numbers, disk above block */
+static int *entry_of = NULL;
+
+/* the payloads in use chained by hash, a power of two number of chains,
+ * and the free payloads chained through the same "next" field; -1 ends a
+ * chain */
+static int *hash_chains = NULL;
+static uint32_t chain_mask = 0;
+static int free_payloads = -1;
+
+static uint32_t block_key(int disk_num, int block_num) {
+  return ((uint32_t)disk_num << geometry.block_shift) | block_num;
+}
 
 int cache_create(int num_entries) {
-  // allocates space for the cache and sets all values to 0 if there is more than 1 entry and less than 4097 entries and the cache is not already enabled
-  if (num_entries <= 4096 && num_entries >= 2 && !cache_enabled()){
-    cache_size = num_entries;
-    cache = calloc(num_entries, sizeof(cache_entry_t));
+  // allocates space for the cache and sets all values to 0 if there is more than 1 entry and no more entries than blocks in the array and the cache is not already enabled
+  if (num_entries <= (int)geometry.num_blocks && num_entries >= 2 && !cache_enabled()){
+    // the payloads take the memory of |num_entries| blocks, the entries that
+    // share them are cheap so there are CACHE_DEDUP_FACTOR times as many
+    num_payloads = num_entries;
+    cache_size = num_entries * CACHE_DEDUP_FACTOR;
+    uint32_t num_chains = 1;
+    while (num_chains < (uint32_t)num_payloads){
+      num_chains <<= 1;
+    }
+    size_t num_keys = (size_t)geometry.num_disks << geometry.block_shift;
+    payloads = calloc(num_payloads, sizeof(cache_payload_t));
+    cache = calloc(cache_size, sizeof(cache_entry_t));
+    entry_of = malloc(num_keys * sizeof(int));
+    hash_chains = malloc(num_chains * sizeof(int));
+    if (payloads == NULL || cache == NULL || entry_of == NULL || hash_chains == NULL){
+      free(payloads);
+      free(cache);
+      free(entry_of);
+      free(hash_chains);
+      payloads = NULL;
+      cache = NULL;
+      entry_of = NULL;
+      hash_chains = NULL;
+      cache_size = 0;
+      num_payloads = 0;
+      return -1;
+    }
+    for (size_t i = 0; i < num_keys; i++){
+      entry_of[i] = -1;
+    }
+    for (uint32_t i = 0; i < num_chains; i++){
+      hash_chains[i] = -1;
+    }
+    chain_mask = num_chains - 1;
+    // every payload starts out free, the lowest positions first
+    for (int i = 0; i < num_payloads; i++){
+      payloads[i].next = i + 1 < num_payloads ? i + 1 : -1;
+    }
+    free_payloads = 0;
     return 1;
   }
   return -1;
 }
 
 int cache_destroy(void) {
-  // frees "cache", sets "cache" to NULL, and sets "cache_size" to 0 if the cache is enabled
+  // frees "cache" and "payloads", sets them to NULL, and sets the sizes to 0 if the cache is enabled
   if (cache_enabled()){
+    // the victim cache would go stale without the writes seen here
+    vcache_destroy();
     free(cache);
+    free(payloads);
+    free(entry_of);
+    free(hash_chains);
     cache = NULL;
+    payloads = NULL;
+    entry_of = NULL;
+    hash_chains = NULL;
     cache_size = 0;
+    num_payloads = 0;
+    num_valid = 0;
     return 1;
   }
   return -1;
 }
 
+/* hashes the contents of a block; constant blocks, which are common, are
+ * recognized without running the checksum */
+static uint32_t hash_block(const uint8_t *buf) {
+  uint8_t fill;
+  if (block_is_fill(buf, JBOD_BLOCK_SIZE, &fill)){
+    return fill;
+  }
+  return crc32c(buf, JBOD_BLOCK_SIZE) | 0x100;
+}
+
+/* returns the position of the valid entry for the block at |disk_num| and
+ * |block_num|, or -1 */
+static int find_entry(int disk_num, int block_num) {
+  if (!cache_enabled() || disk_num < 0 || disk_num >= geometry.num_disks || block_num < 0 || block_num >= geometry.blocks_per_disk){
+    return -1;
+  }
+  return entry_of[block_key(disk_num, block_num)];
+}
+
+/* drops the reference entry |pos| holds on its payload and invalidates it;
+ * a payload nothing refers to any more leaves its hash chain and is free */
+static void release_entry(int pos) {
+  int p = cache[pos].payload;
+  if (--payloads[p].refs == 0){
+    int *link = &hash_chains[payloads[p].hash & chain_mask];
+    while (*link != p){
+      link = &payloads[*link].next;
+    }
+    *link = payloads[p].next;
+    payloads[p].next = free_payloads;
+    free_payloads = p;
+  }
+  entry_of[block_key(cache[pos].disk_num, cache[pos].block_num)] = -1;
+  cache[pos].valid = false;
+  num_valid--;
+}
+
+/* evicts the least accessed entry in the cache, into the victim cache if
+ * there is one */
+static void evict_least_accessed(void) {
+  int least = -1;
+  for (int i=0; i < cache_size; i++){
+    if (cache[i].valid && (least == -1 || cache[i].num_accesses < cache[least].num_accesses)){
+      least = i;
+    }
+  }
+  vcache_put(cache[least].disk_num, cache[least].block_num, payloads[cache[least].payload].block);
+  release_entry(least);
+}
+
+/* returns the position of a payload holding the contents of |buf|, with a
+ * new reference taken on it; stores the contents in a free payload if no
+ * payload holds them yet, evicting entries until one is free */
+static int acquire_payload(const uint8_t *buf) {
+  uint32_t hash = hash_block(buf);
+  int *chain = &hash_chains[hash & chain_mask];
+  num_stores++;
+  for (int p = *chain; p != -1; p = payloads[p].next){
+    if (payloads[p].hash == hash && memcmp(payloads[p].block, buf, JBOD_BLOCK_SIZE) == 0){
+      payloads[p].refs++;
+      num_shared_stores++;
+      return p;
+    }
+  }
+  while (free_payloads == -1){
+    evict_least_accessed();
+  }
+  int free_pos = free_payloads;
+  free_payloads = payloads[free_pos].next;
+  payloads[free_pos].refs = 1;
+  payloads[free_pos].hash = hash;
+  memcpy(payloads[free_pos].block, buf, JBOD_BLOCK_SIZE);
+  payloads[free_pos].next = *chain;
+  *chain = free_pos;
+  return free_pos;
+}
+
+static void insert_entry(int disk_num, int block_num, const uint8_t *buf);
+
 int cache_lookup(int disk_num, int block_num, uint8_t *buf) {
   // makes sure that the cache is enabled and "buf" is not NULL
   if (cache_enabled() && buf != NULL){
+    uint64_t start = clock_ns();
     num_queries++;
-    // loops through the cache looking for an entry with the same "disk_num" and "block_num"
-    for (int i=0; i < cache_size; i++){
-      if (cache[i].disk_num == disk_num && cache[i].block_num == block_num && cache[i].valid == true){
-	// copies the cache block into "buf" if a matching entry is found
-        for (int j=0; j < JBOD_BLOCK_SIZE; j++){
-	  buf[j] = cache[i].block[j];
-	}
-	cache[i].num_accesses++;
-	num_hits++;
-	return 1;
-      }
+    int i = find_entry(disk_num, block_num);
+    if (i != -1){
+      // copies the cached payload into "buf" if a matching entry is found
+      memcpy(buf, payloads[cache[i].payload].block, JBOD_BLOCK_SIZE);
+      cache[i].num_accesses++;
+      num_hits++;
+      hit_ns += clock_ns() - start;
+      return 1;
+    }
+    // falls back to the victim cache and promotes what it finds, which
+    // keeps its copy there as the contents did not change
+    if (vcache_lookup(disk_num, block_num, buf) == 1){
+      insert_entry(disk_num, block_num, buf);
+      return 1;
     }
   }
   return -1;
 }
 
+bool cache_holds(int disk_num, int block_num, const uint8_t *buf) {
+  int i = find_entry(disk_num, block_num);
+  return i != -1 && memcmp(payloads[cache[i].payload].block, buf, JBOD_BLOCK_SIZE) == 0;
+}
+
 void cache_update(int disk_num, int block_num, const uint8_t *buf) {
-  for (int i=0; i < cache_size; i++){
-    // loops through the cache looking for an entry with the same "disk_num" and "block_num"
-    if (cache[i].disk_num == disk_num && cache[i].block_num == block_num && cache[i].valid == true){
-      cache[i].num_accesses++;
-      // copies "buf" into the "block" value of "cache"
-      for (int j=0; j < JBOD_BLOCK_SIZE; j++){
-	cache[i].block[j] = buf[j];
-      }
+  int i = find_entry(disk_num, block_num);
+  if (i != -1){
+    cache[i].num_accesses++;
+    // points the entry at a payload with the new contents; the entry is
+    // invalid meanwhile so that making room for the payload cannot evict it
+    if (memcmp(payloads[cache[i].payload].block, buf, JBOD_BLOCK_SIZE) != 0){
+      vcache_drop(disk_num, block_num);
+      release_entry(i);
+      cache[i].payload = acquire_payload(buf);
+      cache[i].valid = true;
+      entry_of[block_key(disk_num, block_num)] = i;
+      num_valid++;
     }
   }
 }
 
 void replace_cache_entry(int pos, int disk_num, int block_num, const uint8_t *buf){
   // replaces a cache entry by changing every value to the values of the new entry
-  cache[pos].valid = true;
   cache[pos].disk_num = disk_num;
   cache[pos].block_num = block_num;
   cache[pos].num_accesses = 1;
-  for (int i=0; i < JBOD_BLOCK_SIZE; i++){
-    cache[pos].block[i] = buf[i];
+  cache[pos].payload = acquire_payload(buf);
+  cache[pos].valid = true;
+  entry_of[block_key(disk_num, block_num)] = pos;
+  num_valid++;
+  if (num_valid > peak_valid){
+    peak_valid = num_valid;
+  }
+}
+
+/* inserts a new entry into an empty slot in the cache if there is one, and
+ * into the slot of the least accessed entry otherwise */
+static void insert_entry(int disk_num, int block_num, const uint8_t *buf) {
+  for (int i=0; i < cache_size; i++){
+    if (cache[i].valid == false){
+      replace_cache_entry(i, disk_num, block_num, buf);
+      return;
+    }
+  }
+  evict_least_accessed();
+  for (int i=0; i < cache_size; i++){
+    if (cache[i].valid == false){
+      replace_cache_entry(i, disk_num, block_num, buf);
+      return;
+    }
   }
 }
 
 int cache_insert(int disk_num, int block_num, const uint8_t *buf) {
   // makes sure that the cache is enabled and that "disk_num" and "block_num" are valid
-  if (buf != NULL && cache_enabled() && disk_num >= 0 && disk_num <= JBOD_NUM_DISKS && block_num >= 0 && block_num <= JBOD_NUM_BLOCKS_PER_DISK){
+  if (buf != NULL && cache_enabled() && disk_num >= 0 && disk_num < geometry.num_disks && block_num >= 0 && block_num < geometry.blocks_per_disk){
     // checks if the entry already exists and updates it if it does
-    for (int i=0; i < cache_size; i++){
-      // loops through the cache looking for an entry with the same "disk_num" and "block_num"
-      if (cache[i].disk_num == disk_num && cache[i].block_num == block_num && cache[i].valid == true){
-	cache_update(disk_num, block_num, buf);
-	return -1;
-      }
+    if (find_entry(disk_num, block_num) != -1){
+      cache_update(disk_num, block_num, buf);
+      return -1;
     }
-    // least_accessed[0] = number of accesses of the least accesed entry
-    // least_accessed[1] = position of the entry in the cache
-    int least_accessed[2] = {cache[0].num_accesses, 0};
-    for (int i=0; i < cache_size; i++){
-      // inserts the entry into an empty slot in the cache if there is one
-      if (cache[i].valid == false){
-        replace_cache_entry(i, disk_num, block_num, buf);
-	return 1;
-      }
-      // finds the least accessed entry in the cache
-      if (cache[i].num_accesses < least_accessed[0]){
-	least_accessed[0] = cache[i].num_accesses;
-	least_accessed[1] = i;
-      }
-    }
-    replace_cache_entry(least_accessed[1], disk_num, block_num, buf);
+    // this copy is the newest, so a victim cache copy may be stale
+    vcache_drop(disk_num, block_num);
+    insert_entry(disk_num, block_num, buf);
     return 1;
   }
   return -1;
 }
 
+void cache_invalidate(int disk_num, int block_num) {
+  int i = find_entry(disk_num, block_num);
+  if (i != -1){
+    release_entry(i);
+  }
+  vcache_drop(disk_num, block_num);
+}
+
 bool cache_enabled(void) {
   return cache != NULL && cache_size > 0;
 }
@@ -116,4 +291,12 @@ bool cache_enabled(void) {
 void cache_print_hit_rate(void) {
   fprintf(stderr, "num_hits: %d, num_queries: %d\n", num_hits, num_queries);
   fprintf(stderr, "Hit rate: %5.1f%%\n", 100 * (float) num_hits / num_queries);
+  if (num_hits > 0){
+    fprintf(stderr, "cache: %.2f us per hit\n", hit_ns / 1000.0 / num_hits);
+  }
+  vcache_print_stats();
+  if (num_stores > 0){
+    fprintf(stderr, "Deduplicated stores: %d of %d (%5.1f%%), peak entries: %d\n",
+	    num_shared_stores, num_stores, 100 * (float) num_shared_stores / num_stores, peak_valid);
+  }
 }
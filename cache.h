@@ -7,26 +7,41 @@
 #include "jbod.h"
 #include "util.h"
 
+/* each distinct block content is stored once, in a payload shared by all
+ * the entries whose block holds it */
+typedef struct {
+  int refs;
+  uint32_t hash;
+  int next;                 /* the next payload with the same hash bucket, or free */
+  uint8_t block[JBOD_BLOCK_SIZE];
+} cache_payload_t;
+
 typedef struct {
   bool valid;
   int disk_num;
   int block_num;
-  uint8_t block[JBOD_BLOCK_SIZE];
+  int payload;
   int num_accesses;
 } cache_entry_t;
 
+/* the number of entries per payload, i.e. how far deduplication can stretch
+ * the cache beyond the blocks it has memory for */
+#define CACHE_DEDUP_FACTOR 4
+
 /* Returns 1 on success and -1 on failure. Should allocate a space for
- * |num_entries| cache entries, each of type cache_entry_t. Calling it again
+ * |num_entries| payloads and CACHE_DEDUP_FACTOR times as many cache entries
+ * referring to them, so blocks with identical contents share memory. Calling it again
  * without first calling cache_destroy (see below) should fail. */
 int cache_create(int num_entries);
 
 /* Returns 1 on success and -1 on failure. Frees the space allocated by
- * cache_create function above. */
+ * cache_create function above, and the victim cache with it. */
 int cache_destroy(void);
 
 /* Returns 1 on success and -1 on failure. Looks up the block located at
  * |disk_num| and |block_num| in cache and if found, copies the corresponding
- * block to |buf|, which must not be NULL. */
+ * block to |buf|, which must not be NULL. On a miss, a block found in the
+ * victim cache (see vcache.h) is returned and moved into the cache. */
 int cache_lookup(int disk_num, int block_num, uint8_t *buf);
 
 /* Returns 1 on success and -1 on failure. Inserts an entry for |disk_num| and
@@ -35,14 +50,24 @@ int cache_lookup(int disk_num, int block_num, uint8_t *buf);
  * recently used entry and insert the new entry. */
 int cache_insert(int disk_num, int block_num, const uint8_t *buf);
 
+/* Returns true if the cache holds the block located at |disk_num| and
+ * |block_num| and its contents are exactly those of |buf|. Does not count
+ * as a query. */
+bool cache_holds(int disk_num, int block_num, const uint8_t *buf);
+
 /* If the entry with |disk_num| and |block_num| exists, updates the
  * corresponding block with data from |buf| */
 void cache_update(int disk_num, int block_num, const uint8_t *buf);
 
+/* Forgets the block at |disk_num| and |block_num| in both cache tiers,
+ * e.g. because its contents on the disk are about to change unseen. */
+void cache_invalidate(int disk_num, int block_num);
+
 /* Returns true if cache is enabled and false if not. */
 bool cache_enabled(void);
 
-/* Prints the hit rate of the cache. */
+/* Prints the hit rate of the cache, how much of it was deduplicated and
+ * the hit latency, followed by the victim cache statistics. */
 void cache_print_hit_rate(void);
 
 #endif
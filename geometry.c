@@ -0,0 +1,60 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "geometry.h"
+#include "jbod.h"
+
+geometry_t geometry = {
+  .num_disks = JBOD_NUM_DISKS,
+  .blocks_per_disk = JBOD_NUM_BLOCKS_PER_DISK,
+  .disk_size = JBOD_DISK_SIZE,
+  .num_blocks = JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK,
+  .is_default = true,
+  .disks_pow2 = true,
+  .blocks_pow2 = true,
+  .disk_mask = JBOD_NUM_DISKS - 1,
+  .block_mask = JBOD_NUM_BLOCKS_PER_DISK - 1,
+  .disk_shift = 4,
+  .block_shift = 8,
+  .disk_bits = 4,
+  .block_bits = 8,
+  .cmd_shift = 12,
+};
+
+/* returns the number of bits needed to store the numbers 0 to n - 1 */
+static int bits_for(uint32_t n) {
+  int bits = 0;
+  while (((uint32_t)1 << bits) < n)
+    bits++;
+  return bits;
+}
+
+int geometry_set(int num_disks, int blocks_per_disk) {
+  if (num_disks < 2 || num_disks > GEOM_MAX_DISKS || blocks_per_disk < 1)
+    return -1;
+  // byte addresses are 32 bits wide and an op needs 6 bits for the command
+  uint64_t num_blocks = (uint64_t)num_disks * blocks_per_disk;
+  if (num_blocks * JBOD_BLOCK_SIZE > UINT32_MAX)
+    return -1;
+  int disk_shift = bits_for(num_disks), block_shift = bits_for(blocks_per_disk);
+  int disk_bits = disk_shift > GEOM_MIN_DISK_BITS ? disk_shift : GEOM_MIN_DISK_BITS;
+  int block_bits = block_shift > GEOM_MIN_BLOCK_BITS ? block_shift : GEOM_MIN_BLOCK_BITS;
+  if (disk_bits + block_bits + 6 > 32)
+    return -1;
+
+  geometry.num_disks = num_disks;
+  geometry.blocks_per_disk = blocks_per_disk;
+  geometry.disk_size = blocks_per_disk * JBOD_BLOCK_SIZE;
+  geometry.num_blocks = num_blocks;
+  geometry.is_default = num_disks == JBOD_NUM_DISKS && blocks_per_disk == JBOD_NUM_BLOCKS_PER_DISK;
+  geometry.disks_pow2 = (num_disks & (num_disks - 1)) == 0;
+  geometry.blocks_pow2 = (blocks_per_disk & (blocks_per_disk - 1)) == 0;
+  geometry.disk_mask = num_disks - 1;
+  geometry.block_mask = blocks_per_disk - 1;
+  geometry.disk_shift = disk_shift;
+  geometry.block_shift = block_shift;
+  geometry.disk_bits = disk_bits;
+  geometry.block_bits = block_bits;
+  geometry.cmd_shift = disk_bits + block_bits;
+  return 1;
+}
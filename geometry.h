@@ -0,0 +1,94 @@
+#ifndef GEOMETRY_H_
+#define GEOMETRY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "jbod.h"
+
+/* the most disks an array can have; the block size is JBOD_BLOCK_SIZE
+ * whatever the geometry, since the wire protocol carries whole blocks */
+#define GEOM_MAX_DISKS 256
+
+/* the narrowest disk and block fields of an op, those of the classic
+ * layout, so that smaller geometries still talk to a stock server */
+#define GEOM_MIN_DISK_BITS 4
+#define GEOM_MIN_BLOCK_BITS 8
+
+/* the shape of the array, JBOD_NUM_DISKS disks of JBOD_NUM_BLOCKS_PER_DISK
+ * blocks until geometry_set changes it, and the decoding derived from it */
+typedef struct {
+  int num_disks;
+  int blocks_per_disk;
+  uint32_t disk_size;       /* bytes per disk */
+  uint32_t num_blocks;      /* blocks in the whole array */
+  bool is_default;          /* the geometry is the default one */
+  bool disks_pow2;          /* num_disks is a power of two */
+  bool blocks_pow2;         /* blocks_per_disk is a power of two */
+  uint32_t disk_mask;       /* num_disks - 1 */
+  uint32_t block_mask;      /* blocks_per_disk - 1 */
+  int disk_shift;           /* bits a disk number needs, its log2 when disks_pow2 */
+  int block_shift;          /* bits a block number needs, its log2 when blocks_pow2 */
+  int disk_bits;            /* width of the disk field of an op */
+  int block_bits;           /* width of the block field of an op */
+  int cmd_shift;            /* where the command starts in an op */
+} geometry_t;
+
+extern geometry_t geometry;
+
+/* Returns 1 on success and -1 on failure. Sets the number of disks and of
+ * blocks per disk; an op then packs the block number in its low
+ * block_bits, the disk number above it and the command above both. The
+ * fields keep the classic cmd << 12 | disk << 8 | block widths and only
+ * grow when a number does not fit in them. */
+int geometry_set(int num_disks, int blocks_per_disk);
+
+/* The helpers below test for the default geometry first and decode it with
+ * the constants the code used before the geometry was configurable. The
+ * test still costs a branch per call, so map_block in mdadm.c picks its
+ * decoding once at mount instead; see bench_geometry.c. */
+
+/* Returns |n| divided by the number of disks and stores the remainder in
+ * |rem|; a shift and a mask for a power of two number of disks. */
+static inline uint32_t geom_div_disks(uint32_t n, uint32_t *rem) {
+  if (geometry.is_default) {
+    *rem = n % JBOD_NUM_DISKS;
+    return n / JBOD_NUM_DISKS;
+  }
+  if (geometry.disks_pow2) {
+    *rem = n & geometry.disk_mask;
+    return n >> geometry.disk_shift;
+  }
+  *rem = n % geometry.num_disks;
+  return n / geometry.num_disks;
+}
+
+/* Like geom_div_disks, for the number of blocks per disk. */
+static inline uint32_t geom_div_blocks(uint32_t n, uint32_t *rem) {
+  if (geometry.is_default) {
+    *rem = n % JBOD_NUM_BLOCKS_PER_DISK;
+    return n / JBOD_NUM_BLOCKS_PER_DISK;
+  }
+  if (geometry.blocks_pow2) {
+    *rem = n & geometry.block_mask;
+    return n >> geometry.block_shift;
+  }
+  *rem = n % geometry.blocks_per_disk;
+  return n / geometry.blocks_per_disk;
+}
+
+static inline uint32_t geom_encode_op(jbod_cmd_t cmd, int disk_num, int block_num) {
+  if (geometry.is_default) {
+    return ((uint32_t)cmd << 12) | ((uint32_t)disk_num << 8) | block_num;
+  }
+  return ((uint32_t)cmd << geometry.cmd_shift) | ((uint32_t)disk_num << geometry.block_bits) | block_num;
+}
+
+static inline jbod_cmd_t geom_op_cmd(uint32_t op) {
+  if (geometry.is_default) {
+    return (op >> 12) & 0x3F;
+  }
+  return (op >> geometry.cmd_shift) & 0x3F;
+}
+
+#endif
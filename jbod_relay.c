@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "jbod.h"
+#include "net.h"
+
+/* Sits next to a JBOD server and serves clients that negotiated compressed
+ * frames: every frame is unpacked, its requests are forwarded to the server
+ * and the responses go back packed in one frame. */
+
+#define RELAY_ARGUMENTS "hp:s:l:"
+#define USAGE                                                         \
+  "USAGE: jbod_relay [-h] [-p port] [-s server_port] [-l bytes_per_sec] \n" \
+  "\n"                                                                \
+  "where:\n"                                                          \
+  "    -h - help mode (display this message)\n"                       \
+  "    -p - port to accept clients on (default 3334)\n"               \
+  "    -s - port of the JBOD server on this host (default 3333)\n"    \
+  "    -l - limit the client link to bytes_per_sec, for benchmarks\n" \
+  "\n"                                                                \
+
+#define RELAY_PORT 3334
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* sleeps until the frame bytes moved since |start| fit in |rate| bytes/s */
+static void throttle(double start, uint64_t start_bytes, uint64_t rate) {
+  double due = start + (double)(jbod_frame_wire_bytes() - start_bytes) / rate;
+  double left = due - now();
+  if (left > 0)
+    usleep(left * 1e6);
+}
+
+static void serve(int sd, uint64_t rate) {
+  static uint8_t reqs[JBOD_FRAME_MAX], resps[JBOD_FRAME_MAX];
+  double start = now();
+  uint64_t start_bytes = jbod_frame_wire_bytes();
+
+  if (!jbod_accept_compression(sd)) {
+    fprintf(stderr, "client did not ask for compression, closing.\n");
+    return;
+  }
+  for (;;) {
+    int len = jbod_recv_frame(sd, reqs, JBOD_FRAME_MAX);
+    if (len == -1)
+      break;
+    len = jbod_client_forward(reqs, len, resps, JBOD_FRAME_MAX);
+    if (len == -1) {
+      fprintf(stderr, "lost the JBOD server, closing.\n");
+      break;
+    }
+    if (rate)
+      throttle(start, start_bytes, rate);
+    if (!jbod_send_frame(sd, resps, len))
+      break;
+  }
+  jbod_print_frame_stats();
+}
+
+int main(int argc, char *argv[])
+{
+  int ch, port = RELAY_PORT, server_port = JBOD_PORT;
+  uint64_t rate = 0;
+
+  while ((ch = getopt(argc, argv, RELAY_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 's':
+        server_port = atoi(optarg);
+        break;
+      case 'l':
+        rate = strtoull(optarg, NULL, 10);
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return -1;
+    }
+  }
+
+  int lsd = socket(AF_INET, SOCK_STREAM, 0);
+  if (lsd == -1)
+    err(1, "socket");
+  int one = 1;
+  setsockopt(lsd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(lsd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(lsd, 1) == -1)
+    err(1, "cannot listen on port %d", port);
+
+  // serves one client at a time, each over its own server connection
+  for (;;) {
+    int sd = accept(lsd, NULL, NULL);
+    if (sd == -1)
+      continue;
+    if (jbod_connect(JBOD_SERVER, server_port)) {
+      serve(sd, rate);
+      jbod_disconnect();
+    } else {
+      fprintf(stderr, "cannot connect to the JBOD server on port %d.\n", server_port);
+    }
+    close(sd);
+  }
+  return 0;
+}
@@ -0,0 +1,118 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_HASH_BITS 12
+
+/* the positions of recently seen 4-byte sequences are kept in a table
+ * indexed by a multiplicative hash of the sequence */
+static uint32_t lz_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* writes the extra bytes of a length that did not fit in its token nibble */
+static int put_length(uint8_t *dst, int pos, int len) {
+  while (len >= 255) {
+    dst[pos++] = 255;
+    len -= 255;
+  }
+  dst[pos++] = len;
+  return pos;
+}
+
+/* writes one sequence: |lit_len| literals from |lit|, then a match of
+ * |match_len| bytes at |offset| unless |match_len| is 0 (the last sequence) */
+static int put_sequence(uint8_t *dst, int pos, const uint8_t *lit, int lit_len, int offset, int match_len) {
+  int token_pos = pos++;
+  int lit_nibble = lit_len < 15 ? lit_len : 15;
+  int match_nibble = 0;
+  if (lit_len >= 15)
+    pos = put_length(dst, pos, lit_len - 15);
+  memcpy(&dst[pos], lit, lit_len);
+  pos += lit_len;
+  if (match_len > 0) {
+    dst[pos++] = offset & 0xFF;
+    dst[pos++] = offset >> 8;
+    match_len -= LZ_MIN_MATCH;
+    match_nibble = match_len < 15 ? match_len : 15;
+    if (match_len >= 15)
+      pos = put_length(dst, pos, match_len - 15);
+  }
+  dst[token_pos] = (lit_nibble << 4) | match_nibble;
+  return pos;
+}
+
+int lz_compress(const uint8_t *src, int len, uint8_t *dst) {
+  int table[1 << LZ_HASH_BITS];
+  int ip = 0, anchor = 0, pos = 0;
+
+  memset(table, 0xFF, sizeof(table));
+  while (ip + LZ_MIN_MATCH <= len) {
+    uint32_t v;
+    memcpy(&v, &src[ip], 4);
+    uint32_t h = lz_hash(v);
+    int ref = table[h];
+    table[h] = ip;
+    if (ref < 0 || ip - ref > LZ_MAX_OFFSET || memcmp(&src[ref], &src[ip], LZ_MIN_MATCH) != 0) {
+      ip++;
+      continue;
+    }
+    // extends the match as far as it goes; it may overlap the current position
+    int match_len = LZ_MIN_MATCH;
+    while (ip + match_len < len && src[ref + match_len] == src[ip + match_len])
+      match_len++;
+    pos = put_sequence(dst, pos, &src[anchor], ip - anchor, ip - ref, match_len);
+    ip += match_len;
+    anchor = ip;
+  }
+  return put_sequence(dst, pos, &src[anchor], len - anchor, 0, 0);
+}
+
+/* reads the extra bytes of a length whose token nibble was 15 */
+static int get_length(const uint8_t *src, int len, int *ip, int *value) {
+  uint8_t b;
+  do {
+    if (*ip >= len)
+      return -1;
+    b = src[(*ip)++];
+    *value += b;
+  } while (b == 255);
+  return 0;
+}
+
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap) {
+  int ip = 0, pos = 0;
+
+  while (ip < len) {
+    uint8_t token = src[ip++];
+    int lit_len = token >> 4;
+    if (lit_len == 15 && get_length(src, len, &ip, &lit_len) == -1)
+      return -1;
+    if (lit_len > len - ip || lit_len > cap - pos)
+      return -1;
+    memcpy(&dst[pos], &src[ip], lit_len);
+    ip += lit_len;
+    pos += lit_len;
+    // only the last sequence ends without a match
+    if (ip == len)
+      break;
+    if (len - ip < 2)
+      return -1;
+    int offset = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    int match_len = token & 0x0F;
+    if (match_len == 15 && get_length(src, len, &ip, &match_len) == -1)
+      return -1;
+    match_len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > pos || match_len > cap - pos)
+      return -1;
+    // copies byte by byte since the match may overlap the bytes it produces
+    for (int i = 0; i < match_len; i++)
+      dst[pos + i] = dst[pos - offset + i];
+    pos += match_len;
+  }
+  return pos;
+}
@@ -0,0 +1,19 @@
+#ifndef LZ_H_
+#define LZ_H_
+
+#include <stdint.h>
+
+/* the most bytes lz_compress can produce for |len| bytes of input */
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+/* Compresses |len| bytes of |src| into |dst|, which must hold LZ_BOUND(len)
+ * bytes, and returns the compressed size. The format follows LZ4 blocks:
+ * each sequence is a token, its literals, and a 2-byte match offset. */
+int lz_compress(const uint8_t *src, int len, uint8_t *dst);
+
+/* Decompresses |len| bytes of |src| into |dst|, which holds |cap| bytes.
+ * Returns the decompressed size, or -1 if the input is corrupt or does not
+ * fit. */
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap);
+
+#endif
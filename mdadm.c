@@ -6,14 +6,139 @@
 #include <string.h>
 
 #include "cache.h"
+#include "geometry.h"
 #include "jbod.h"
 #include "mdadm.h"
 #include "net.h"
+#include "sched.h"
+#include "snap.h"
+#include "util.h"
+
+/* the address layout selected for the next mount and the stripe unit as a
+ * power of two number of blocks (used by the striped and RAID-5 layouts) */
+static mdadm_layout_t layout = MDADM_LINEAR;
+static int stripe_shift = 0;
+static bool mounted = false;
+
+/* the disk treated as missing by the RAID-5 layout, or -1 if none is */
+static int failed_disk = -1;
+
+/* counters reported by mdadm_print_stats */
+static int num_block_reads = 0;
+static int num_block_writes = 0;
+static int num_skipped_writes = 0;
+static int num_rmw_writes = 0;
+static int num_reconstruct_writes = 0;
+static int num_full_stripe_writes = 0;
+static int num_degraded_reads = 0;
+static int num_scrubbed_blocks = 0;
+static int num_scrub_mismatches = 0;
+static int num_snapshot_copies = 0;
+static int num_snapshot_reads = 0;
+static int num_requests = 0;
+static int num_passes = 0;
+
+/* the CRC32C each block should have, known once the block has been written
+ * or scrubbed, and whether it was written since the last scrub; indexed by
+ * block_index and sized for the geometry at the first mount after it is set */
+static uint32_t *block_sums = NULL;
+static bool *block_sum_known = NULL;
+static bool *block_dirty = NULL;
+
+/* the most distinct blocks one pass of mdadm_submit stages, so that its
+ * reads and its writes each take one scheduler flush */
+#define MDADM_BATCH_BLOCKS SCHED_QUEUE_DEPTH
+
+/* the scrub reads at most this many consecutive blocks at a time */
+#define MDADM_SCRUB_RUN SCHED_QUEUE_DEPTH
+
+/* returns the position of a block in the per-block arrays */
+static inline uint32_t block_index(int disk_num, int block_num) {
+  return ((uint32_t)disk_num << geometry.block_shift) | block_num;
+}
+
+/* returns whether the stripe unit of |new_layout| suits the geometry */
+static bool layout_fits(mdadm_layout_t new_layout, int stripe_blocks, int num_disks, int blocks_per_disk) {
+  if (new_layout == MDADM_LINEAR){
+    return true;
+  }
+  // RAID-5 needs at least two data disks beside the parity, and every row
+  // of stripe units has to fit on the disks
+  if (new_layout == MDADM_RAID5 && num_disks < 3){
+    return false;
+  }
+  return stripe_blocks <= blocks_per_disk && blocks_per_disk % stripe_blocks == 0;
+}
+
+int mdadm_set_layout(mdadm_layout_t new_layout, int stripe_blocks) {
+  // the layout can only change while the array is unmounted
+  if (mounted || (new_layout != MDADM_LINEAR && new_layout != MDADM_STRIPED && new_layout != MDADM_RAID5)){
+    return -1;
+  }
+  if (new_layout != MDADM_LINEAR){
+    // the stripe unit has to be a power of two that fits on a disk
+    if (stripe_blocks < 1 || (stripe_blocks & (stripe_blocks - 1)) != 0 ||
+	!layout_fits(new_layout, stripe_blocks, geometry.num_disks, geometry.blocks_per_disk)){
+      return -1;
+    }
+    stripe_shift = 0;
+    while ((1 << stripe_shift) < stripe_blocks){
+      stripe_shift++;
+    }
+  }
+  // the snapshots were taken of the old logical address space
+  snap_reset();
+  layout = new_layout;
+  failed_disk = -1;
+  return 1;
+}
+
+int mdadm_set_geometry(int num_disks, int blocks_per_disk) {
+  // the geometry can only change while the array is unmounted, and has to
+  // keep room for the stripe unit of the selected layout
+  if (mounted || !layout_fits(layout, 1 << stripe_shift, num_disks, blocks_per_disk) ||
+      geometry_set(num_disks, blocks_per_disk) == -1){
+    return -1;
+  }
+  // the per-block arrays are sized again on the next mount
+  free(block_sums);
+  free(block_sum_known);
+  free(block_dirty);
+  block_sums = NULL;
+  block_sum_known = NULL;
+  block_dirty = NULL;
+  snap_reset();
+  failed_disk = -1;
+  return 1;
+}
+
+uint32_t mdadm_capacity(void) {
+  // one disk worth of blocks holds the RAID-5 parity
+  if (layout == MDADM_RAID5){
+    return geometry.disk_size*(geometry.num_disks - 1);
+  }
+  return geometry.disk_size*geometry.num_disks;
+}
+
+static void select_map_block(void);
 
 int mdadm_mount(void) {
+  if (block_sums == NULL){
+    // block_index leaves room for a power of two number of blocks per disk
+    size_t n = (size_t)geometry.num_disks << geometry.block_shift;
+    block_sums = calloc(n, sizeof(uint32_t));
+    block_sum_known = calloc(n, sizeof(bool));
+    block_dirty = calloc(n, sizeof(bool));
+    if (block_sums == NULL || block_sum_known == NULL || block_dirty == NULL){
+      return -1;
+    }
+  }
   // moves the bits to the correct position for the mount command and uses the driver function to execute the command
-  int temp = jbod_client_operation(JBOD_MOUNT << 12, NULL);
+  int temp = jbod_client_operation(geom_encode_op(JBOD_MOUNT, 0, 0), NULL);
   if (temp == 0){
+    mounted = true;
+    select_map_block();
+    sched_reset_head();
     return 1;
   } else {
     return -1;
@@ -22,8 +147,10 @@ int mdadm_mount(void) {
 
 int mdadm_unmount(void) {
   // moves the bits to the correct position for the unmount command and uses the driver function to execute the command
-  int temp = jbod_client_operation(JBOD_UNMOUNT << 12, NULL);
+  int temp = jbod_client_operation(geom_encode_op(JBOD_UNMOUNT, 0, 0), NULL);
   if (temp == 0){
+    mounted = false;
+    sched_reset_head();
     return 1;
   } else {
     return -1;
@@ -32,7 +159,7 @@ int mdadm_unmount(void) {
 
 int mdadm_write_permission(void){
   // moves the bits to the correct position for the write permission command and uses the driver function to execute the command
-  int temp = jbod_client_operation(JBOD_WRITE_PERMISSION << 12, NULL);
+  int temp = jbod_client_operation(geom_encode_op(JBOD_WRITE_PERMISSION, 0, 0), NULL);
   if (temp == 0){
     return 1;
   } else {
@@ -43,7 +170,7 @@ int mdadm_write_permission(void){
 
 int mdadm_revoke_write_permission(void){
   // moves the bits to the correct position for the revoke write permission command and uses the driver function to execute the command
-  int temp = jbod_client_operation(JBOD_REVOKE_WRITE_PERMISSION << 12, NULL);
+  int temp = jbod_client_operation(geom_encode_op(JBOD_REVOKE_WRITE_PERMISSION, 0, 0), NULL);
   if (temp == 0){
     return 1;
   } else {
@@ -51,152 +178,718 @@ int mdadm_revoke_write_permission(void){
   }
 }
 
+/* returns the disk holding the RAID-5 parity of every block at |block_num|;
+ * it moves one disk to the left with each row of stripe units */
+static int parity_disk(int block_num) {
+  uint32_t row_disk;
+  geom_div_disks(block_num >> stripe_shift, &row_disk);
+  return geometry.num_disks - 1 - row_disk;
+}
 
-int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf) {
-  // makes sure the inputs are valid
-  if (len <= 2048 && mdadm_mount() == -1 && addr + len <= JBOD_DISK_SIZE*JBOD_NUM_DISKS){
-    if (len == 0 && buf == NULL){
-      return 0;
-    } else if (buf == NULL){
-      return -1;
+/* the mappings of the logical block |lblock| to the disk and block that
+ * store it, one per layout; the _default ones are those of the default
+ * geometry, written with its constants like before the geometry became
+ * configurable, and mdadm_mount picks the one map_block calls */
+
+static void map_linear(uint32_t lblock, int *disk_num, int *block_num) {
+  uint32_t block;
+  *disk_num = geom_div_blocks(lblock, &block);
+  *block_num = block;
+}
+
+static void map_linear_default(uint32_t lblock, int *disk_num, int *block_num) {
+  *disk_num = lblock / JBOD_NUM_BLOCKS_PER_DISK;
+  *block_num = lblock % JBOD_NUM_BLOCKS_PER_DISK;
+}
+
+static void map_striped(uint32_t lblock, int *disk_num, int *block_num) {
+  // consecutive stripe units rotate across the disks, each row of units
+  // occupies the next "1 << stripe_shift" blocks of every disk
+  uint32_t unit = lblock >> stripe_shift, disk;
+  *block_num = (geom_div_disks(unit, &disk) << stripe_shift) | (lblock & ((1 << stripe_shift) - 1));
+  *disk_num = disk;
+}
+
+static void map_striped_default(uint32_t lblock, int *disk_num, int *block_num) {
+  uint32_t unit = lblock >> stripe_shift;
+  *block_num = ((unit / JBOD_NUM_DISKS) << stripe_shift) | (lblock & ((1 << stripe_shift) - 1));
+  *disk_num = unit % JBOD_NUM_DISKS;
+}
+
+static void map_raid5(uint32_t lblock, int *disk_num, int *block_num) {
+  // like the striped layout, but each row holds one stripe unit less and
+  // the data units skip over the row's parity disk
+  uint32_t unit = lblock >> stripe_shift;
+  int data_index = unit % (geometry.num_disks - 1);
+  *block_num = ((unit / (geometry.num_disks - 1)) << stripe_shift) | (lblock & ((1 << stripe_shift) - 1));
+  int parity = parity_disk(*block_num);
+  *disk_num = data_index < parity ? data_index : data_index + 1;
+}
+
+static void map_raid5_default(uint32_t lblock, int *disk_num, int *block_num) {
+  uint32_t unit = lblock >> stripe_shift;
+  int data_index = unit % (JBOD_NUM_DISKS - 1);
+  *block_num = ((unit / (JBOD_NUM_DISKS - 1)) << stripe_shift) | (lblock & ((1 << stripe_shift) - 1));
+  int parity = JBOD_NUM_DISKS - 1 - (*block_num >> stripe_shift) % JBOD_NUM_DISKS;
+  *disk_num = data_index < parity ? data_index : data_index + 1;
+}
+
+/* maps a logical block with the mapping of the mounted layout and geometry */
+static void (*map_block)(uint32_t lblock, int *disk_num, int *block_num) = map_linear_default;
+
+/* picks map_block; the layout and the geometry only change while the
+ * array is unmounted, so once per mount is enough */
+static void select_map_block(void) {
+  if (layout == MDADM_RAID5){
+    map_block = geometry.is_default ? map_raid5_default : map_raid5;
+  } else if (layout == MDADM_STRIPED){
+    map_block = geometry.is_default ? map_striped_default : map_striped;
+  } else {
+    map_block = geometry.is_default ? map_linear_default : map_linear;
+  }
+}
+
+static int read_blocks(int count, const int *disk_nums, const int *block_nums, uint8_t **blocks);
+
+/* rebuilds the block of the failed disk at |block_num| by XORing together
+ * the blocks of every other disk at the same position (data and parity) */
+static int reconstruct_block(int block_num, uint8_t *block) {
+  uint8_t others[geometry.num_disks - 1][JBOD_BLOCK_SIZE];
+  int disk_nums[geometry.num_disks - 1], block_nums[geometry.num_disks - 1];
+  uint8_t *bufs[geometry.num_disks - 1];
+  int count = 0;
+  for (int i = 0; i < geometry.num_disks; i++){
+    if (i != failed_disk){
+      disk_nums[count] = i;
+      block_nums[count] = block_num;
+      bufs[count] = others[count];
+      count++;
     }
-    int result;
-    int bytes_left = len;
-    int disk_start  = (0xF0000 & addr) >> 16;
-    uint8_t block[JBOD_BLOCK_SIZE];
-    // loops through the disks starting at the starting disk
-    for (int i = disk_start; i < JBOD_NUM_DISKS; i++){
-      // moves to the current disk by using the seek to disk command along with the address of the current disk
-      result = jbod_client_operation((JBOD_SEEK_TO_DISK << 12) | (i << 8), NULL);
-      if (result == -1){
+  }
+  if (read_blocks(count, disk_nums, block_nums, bufs) == -1){
+    return -1;
+  }
+  memset(block, 0, JBOD_BLOCK_SIZE);
+  for (int i = 0; i < count; i++){
+    xor_block(block, others[i], JBOD_BLOCK_SIZE);
+  }
+  num_degraded_reads++;
+  return 0;
+}
+
+/* reads |count| whole blocks into |blocks|, from the cache when possible and
+ * by reconstruction when their disk has failed; the rest are queued with the
+ * scheduler and fetched together. returns 0 on success and -1 on failure */
+static int read_blocks(int count, const int *disk_nums, const int *block_nums, uint8_t **blocks) {
+  bool queued[count];
+  for (int i = 0; i < count; i++){
+    queued[i] = false;
+    if (cache_lookup(disk_nums[i], block_nums[i], blocks[i]) == 1){
+      continue;
+    }
+    if (disk_nums[i] == failed_disk){
+      if (reconstruct_block(block_nums[i], blocks[i]) == -1){
 	return -1;
       }
-      // starts at the starting block address if the start disk is the current disk, starts at 0 otherwise
-      int block_start;
-      if (i == disk_start){
-	block_start = (0x0FF00 & addr) >> 8;
-      } else {
-	block_start = 0;
-      }
-      // uses the seek to block command to set the current block
-      result = jbod_client_operation((JBOD_SEEK_TO_BLOCK << 12) | block_start, NULL);
-      if (result == -1){
+      cache_insert(disk_nums[i], block_nums[i], blocks[i]);
+      continue;
+    }
+    if (sched_read(disk_nums[i], block_nums[i], blocks[i]) == -1){
+      return -1;
+    }
+    queued[i] = true;
+  }
+  if (sched_flush() == -1){
+    return -1;
+  }
+  // inserts the blocks that came from the disks into the cache
+  for (int i = 0; i < count; i++){
+    if (queued[i]){
+      num_block_reads++;
+      cache_insert(disk_nums[i], block_nums[i], blocks[i]);
+    }
+  }
+  return 0;
+}
+
+/* remembers what a block written to the disk should read back as for the
+ * next scrub */
+static void note_written(int disk_num, int block_num, const uint8_t *block) {
+  uint32_t index = block_index(disk_num, block_num);
+  num_block_writes++;
+  block_sums[index] = crc32c(block, JBOD_BLOCK_SIZE);
+  block_sum_known[index] = true;
+  block_dirty[index] = true;
+}
+
+/* writes one whole block from |block| to the disk, even a failed one;
+ * returns 0 on success and -1 on failure */
+static int store_block(int disk_num, int block_num, uint8_t *block) {
+  if (sched_write(disk_num, block_num, block) == -1 || sched_flush() == -1){
+    return -1;
+  }
+  note_written(disk_num, block_num, block);
+  return 0;
+}
+
+/* writes |count| whole blocks from |blocks| in one scheduler flush and keeps
+ * the cache in sync; blocks of a failed disk only live in the cache and in
+ * the parity until the rebuild. returns 0 on success and -1 on failure */
+static int write_blocks(int count, const int *disk_nums, const int *block_nums, uint8_t **blocks) {
+  bool queued[count];
+  for (int i = 0; i < count; i++){
+    queued[i] = false;
+    // the cache mirrors the disks, so a block it holds with these exact
+    // contents already is on the disk and only needs its access counted
+    if (cache_holds(disk_nums[i], block_nums[i], blocks[i])){
+      cache_update(disk_nums[i], block_nums[i], blocks[i]);
+      num_skipped_writes++;
+      continue;
+    }
+    if (disk_nums[i] != failed_disk){
+      if (sched_write(disk_nums[i], block_nums[i], blocks[i]) == -1){
 	return -1;
-       }
-      // loops through the blocks of the current disk starting at "block_start"
-      for (int j = block_start; j < JBOD_NUM_BLOCKS_PER_DISK; j++){
-	// checks the cache for the current block in the current disk
-	result = cache_lookup(i, j, block);
-	bool next_block = false;
-	if (result == 1){
-	  next_block = true;
-	} else {
-	  // uses the read block command to read the current block to "block"
-	  result = jbod_client_operation(JBOD_READ_BLOCK << 12, block);
-	  if (result == -1){
-	    return -1;
-	  }
-	  // inserts the current block into the cache
-	  cache_insert(i, j, block);
-	}
-	// starts at the starting byte address if the start block is the current block and the start disk is the current disk
-	int byte_start;
-	if (j == block_start && i == disk_start){
-	  byte_start = addr & 0x000FF;
-	} else {
-	  byte_start = 0;
-	}
-	// sets the current block to the next block if the cache is used
-	if (next_block) {
-	  jbod_client_operation((JBOD_SEEK_TO_BLOCK << 12) | (j+1), NULL);
-	}
-	// loops through the bytes in "block" and inserts them into "buf"
-	for (int k = byte_start; k < JBOD_BLOCK_SIZE; k++){
-	  buf[len-bytes_left] = block[k];
-	  bytes_left -= 1;
-	  // ends the read if there are no bytes left to read
-	  if (bytes_left == 0){
-	    return len;
-	  }
-	}
+      }
+      queued[i] = true;
+    }
+  }
+  if (sched_flush() == -1){
+    return -1;
+  }
+  for (int i = 0; i < count; i++){
+    if (queued[i]){
+      note_written(disk_nums[i], block_nums[i], blocks[i]);
+    }
+    // inserts the block into the cache, or updates it if it is already there
+    if (queued[i] || disk_nums[i] == failed_disk){
+      cache_insert(disk_nums[i], block_nums[i], blocks[i]);
+    }
+  }
+  return 0;
+}
+
+/* keeps the contents of logical block |lblock|, about to be overwritten,
+ * for the snapshots that still see them; returns 0 on success and -1 on
+ * failure */
+static int preserve_block(uint32_t lblock, const uint8_t *block) {
+  if (!snap_needs_copy(lblock)){
+    return 0;
+  }
+  if (snap_preserve(lblock, block) == -1){
+    return -1;
+  }
+  num_snapshot_copies++;
+  return 0;
+}
+
+/* a block of a RAID-5 write: where it goes, its new contents and, once
+ * read, the contents it replaces */
+typedef struct {
+  int disk_num;
+  int block_num;
+  bool has_old;
+  uint8_t old_block[JBOD_BLOCK_SIZE];
+  uint8_t new_block[JBOD_BLOCK_SIZE];
+} raid5_block_t;
+
+/* writes the blocks of |group|, which all share one parity block, and
+ * updates that parity either from the old data and parity (read-modify-write)
+ * or from the blocks of the row that are not being written (reconstruct-write),
+ * whichever needs fewer reads. returns 0 on success and -1 on failure */
+static int raid5_write_group(raid5_block_t **group, int group_len) {
+  int block_num = group[0]->block_num;
+  int parity = parity_disk(block_num);
+  uint8_t parity_block[JBOD_BLOCK_SIZE];
+  bool written[geometry.num_disks];
+  bool failed_written = false;
+  memset(written, 0, sizeof(written));
+  int rmw_reads = 1;
+  for (int i = 0; i < group_len; i++){
+    written[group[i]->disk_num] = true;
+    if (group[i]->disk_num == failed_disk){
+      failed_written = true;
+    }
+    if (!group[i]->has_old){
+      rmw_reads++;
+    }
+  }
+  int reconstruct_reads = geometry.num_disks - 1 - group_len;
+  int disk_nums[geometry.num_disks], block_nums[geometry.num_disks];
+  uint8_t *bufs[geometry.num_disks];
+  uint8_t others[geometry.num_disks][JBOD_BLOCK_SIZE];
+  int count = 0;
+  for (int i = 0; i < geometry.num_disks; i++){
+    block_nums[i] = block_num;
+  }
+  if (parity == failed_disk){
+    // there is no parity to keep up to date, and the copy the cache may
+    // still hold no longer matches the data, so the rebuild must not see it
+    cache_invalidate(parity, block_num);
+  } else if (failed_written || (failed_disk == -1 && reconstruct_reads < rmw_reads)){
+    // computes the parity from the new data and the rest of the row
+    for (int i = 0; i < geometry.num_disks; i++){
+      if (i != parity && !written[i]){
+	disk_nums[count] = i;
+	bufs[count] = others[count];
+	count++;
       }
     }
-    return len;
+    if (read_blocks(count, disk_nums, block_nums, bufs) == -1){
+      return -1;
+    }
+    memset(parity_block, 0, JBOD_BLOCK_SIZE);
+    for (int i = 0; i < group_len; i++){
+      xor_block(parity_block, group[i]->new_block, JBOD_BLOCK_SIZE);
+    }
+    for (int i = 0; i < count; i++){
+      xor_block(parity_block, others[i], JBOD_BLOCK_SIZE);
+    }
+    if (reconstruct_reads == 0){
+      num_full_stripe_writes++;
+    } else {
+      num_reconstruct_writes++;
+    }
   } else {
+    // removes the old data from the parity and adds the new data to it
+    disk_nums[count] = parity;
+    bufs[count++] = parity_block;
+    for (int i = 0; i < group_len; i++){
+      if (!group[i]->has_old){
+	disk_nums[count] = group[i]->disk_num;
+	bufs[count++] = group[i]->old_block;
+	group[i]->has_old = true;
+      }
+    }
+    if (read_blocks(count, disk_nums, block_nums, bufs) == -1){
+      return -1;
+    }
+    for (int i = 0; i < group_len; i++){
+      xor_block(parity_block, group[i]->old_block, JBOD_BLOCK_SIZE);
+      xor_block(parity_block, group[i]->new_block, JBOD_BLOCK_SIZE);
+    }
+    num_rmw_writes++;
+  }
+  // writes the data and the parity together
+  count = 0;
+  for (int i = 0; i < group_len; i++){
+    disk_nums[count] = group[i]->disk_num;
+    bufs[count++] = group[i]->new_block;
+  }
+  if (parity != failed_disk){
+    disk_nums[count] = parity;
+    bufs[count++] = parity_block;
+  }
+  return write_blocks(count, disk_nums, block_nums, bufs);
+}
+
+/* a logical block staged by mdadm_submit: where it lives, whether the batch
+ * needs its contents from before the batch, and whether the batch changed
+ * it; |b| holds those old contents once read and the new ones */
+typedef struct {
+  uint32_t lblock;
+  bool load;
+  bool dirty;
+  raid5_block_t b;
+} staged_block_t;
+
+static staged_block_t staged[MDADM_BATCH_BLOCKS];
+static int num_staged = 0;
+
+/* returns the staged block of |lblock|, staging it if the batch has not
+ * touched it yet; only the first touch decides whether it is loaded, as
+ * later ones see the contents the batch left */
+static staged_block_t *stage_block(uint32_t lblock, bool load) {
+  for (int i = num_staged - 1; i >= 0; i--){
+    if (staged[i].lblock == lblock){
+      return &staged[i];
+    }
+  }
+  staged_block_t *s = &staged[num_staged++];
+  s->lblock = lblock;
+  s->load = load;
+  s->dirty = false;
+  s->b.has_old = false;
+  map_block(lblock, &s->b.disk_num, &s->b.block_num);
+  return s;
+}
+
+/* reads the old contents of the staged blocks that need them, all in one
+ * scheduler flush; returns 0 on success and -1 on failure */
+static int load_staged(void) {
+  int disk_nums[MDADM_BATCH_BLOCKS], block_nums[MDADM_BATCH_BLOCKS];
+  uint8_t *bufs[MDADM_BATCH_BLOCKS];
+  staged_block_t *loaded[MDADM_BATCH_BLOCKS];
+  int count = 0;
+  for (int i = 0; i < num_staged; i++){
+    if (staged[i].load){
+      disk_nums[count] = staged[i].b.disk_num;
+      block_nums[count] = staged[i].b.block_num;
+      bufs[count] = staged[i].b.old_block;
+      loaded[count++] = &staged[i];
+    }
+  }
+  if (count > 0 && read_blocks(count, disk_nums, block_nums, bufs) == -1){
     return -1;
   }
+  for (int i = 0; i < count; i++){
+    memcpy(loaded[i]->b.new_block, loaded[i]->b.old_block, JBOD_BLOCK_SIZE);
+    loaded[i]->b.has_old = true;
+  }
+  return 0;
 }
 
-int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf) {
-  // makes sure the inputs are valid
-  if (len <= 2048 && addr + len <= JBOD_DISK_SIZE*JBOD_NUM_DISKS && mdadm_write_permission() == -1){
-    if (len == 0 && buf == NULL){
-      return 0;
-    } else if (buf == NULL){
+/* writes the staged blocks the batch changed, after keeping their old
+ * contents for the snapshots, in one scheduler flush or, in the RAID-5
+ * layout, one per group of blocks that share a parity block. returns 0 on
+ * success and -1 on failure */
+static int store_staged(void) {
+  int disk_nums[MDADM_BATCH_BLOCKS], block_nums[MDADM_BATCH_BLOCKS];
+  uint8_t *bufs[MDADM_BATCH_BLOCKS];
+  raid5_block_t *dirty[MDADM_BATCH_BLOCKS];
+  int count = 0;
+  for (int i = 0; i < num_staged; i++){
+    if (staged[i].dirty){
+      // a block a snapshot still sees was loaded when it was staged
+      if (preserve_block(staged[i].lblock, staged[i].b.old_block) == -1){
+	return -1;
+      }
+      disk_nums[count] = staged[i].b.disk_num;
+      block_nums[count] = staged[i].b.block_num;
+      bufs[count] = staged[i].b.new_block;
+      dirty[count++] = &staged[i].b;
+    }
+  }
+  if (count == 0){
+    return 0;
+  }
+  if (layout != MDADM_RAID5){
+    return write_blocks(count, disk_nums, block_nums, bufs);
+  }
+  bool done[MDADM_BATCH_BLOCKS] = {false};
+  for (int i = 0; i < count; i++){
+    if (done[i]){
+      continue;
+    }
+    raid5_block_t *group[MDADM_BATCH_BLOCKS];
+    int group_len = 0;
+    for (int j = i; j < count; j++){
+      if (!done[j] && dirty[j]->block_num == dirty[i]->block_num){
+	group[group_len++] = dirty[j];
+	done[j] = true;
+      }
+    }
+    if (raid5_write_group(group, group_len) == -1){
       return -1;
     }
-    int result;
-    int bytes_left = len;
-    int disk_start  = (0xF0000 & addr) >> 16;
-    uint8_t write_block[JBOD_BLOCK_SIZE];
-    // loops through the disks starting at the starting disk
-    for (int i = disk_start; i < JBOD_NUM_DISKS; i++){
-      // starts at the starting block address if the start disk is the current disk, starts at 0 otherwise
-      int block_start;
-      if (i == disk_start){
-	block_start = (0x0FF00 & addr) >> 8;
+  }
+  return 0;
+}
+
+/* runs the first of the |count| requests at |reqs| and as many of the next
+ * ones as fit in one pass: stages their blocks, loads them, applies the
+ * requests in order and stores the result. sets the result of every
+ * request it runs and returns how many that is */
+static int submit_pass(int count, mdadm_request_t *reqs) {
+  num_staged = 0;
+  int taken = 0;
+  for (; taken < count; taken++){
+    mdadm_request_t *req = &reqs[taken];
+    if (req->result == -1 || req->len == 0){
+      continue;
+    }
+    uint32_t first = req->addr / JBOD_BLOCK_SIZE;
+    uint32_t last = (req->addr + req->len - 1) / JBOD_BLOCK_SIZE;
+    if (num_staged + (int)(last - first + 1) > MDADM_BATCH_BLOCKS){
+      break;
+    }
+    // a read, or a write that covers a block only in part or overwrites
+    // what a snapshot still sees, needs the block as it was
+    for (uint32_t lblock = first; lblock <= last; lblock++){
+      bool whole = req->write && req->addr <= lblock * JBOD_BLOCK_SIZE &&
+	(lblock + 1) * JBOD_BLOCK_SIZE <= req->addr + req->len;
+      stage_block(lblock, !whole || snap_needs_copy(lblock));
+    }
+  }
+  if (load_staged() == -1){
+    for (int i = 0; i < taken; i++){
+      reqs[i].result = -1;
+    }
+    return taken;
+  }
+  // copies the bytes of each request from or into the staged blocks, in
+  // order, so a read sees the writes before it
+  bool any_write = false;
+  for (int i = 0; i < taken; i++){
+    mdadm_request_t *req = &reqs[i];
+    if (req->result == -1){
+      continue;
+    }
+    uint32_t pos = 0;
+    while (pos < req->len){
+      uint32_t current_addr = req->addr + pos;
+      staged_block_t *s = stage_block(current_addr / JBOD_BLOCK_SIZE, false);
+      uint32_t byte_start = current_addr % JBOD_BLOCK_SIZE;
+      uint32_t n = JBOD_BLOCK_SIZE - byte_start;
+      if (n > req->len - pos){
+	n = req->len - pos;
+      }
+      if (req->write){
+	memcpy(&s->b.new_block[byte_start], &req->buf[pos], n);
+	s->dirty = true;
       } else {
-	block_start = 0;
-      }
-      // loops through the blocks of the current disk starting at "block_start"
-      for (int j = block_start; j < JBOD_NUM_BLOCKS_PER_DISK; j++){
-	// starts at the starting byte address if the start block is the current block and the start disk is the current disk
-	int byte_start;
-	if (j == block_start && i == disk_start){
-	  byte_start = addr & 0x000FF;
-	} else {
-	  byte_start = 0;
-	}
-        // sets "write_block" equal to the current block
-	uint32_t current_addr = (i << 16) | (j << 8);
-	result = mdadm_read(current_addr, JBOD_BLOCK_SIZE, write_block);
-	if (result == -1){
-	  return -1;
-	}
-	// uses the seek to disk command to set the current disk
-	result = jbod_client_operation((JBOD_SEEK_TO_DISK << 12) | (i << 8), NULL);
-        if (result == -1){
-	  return -1;
-        }
-	// uses the seek to block command to set the current block
-	result = jbod_client_operation((JBOD_SEEK_TO_BLOCK << 12) | j, NULL);
-        if (result == -1){
-	  return -1;
-        }
-	// loops through the bytes in "buf" and inserts them into "write_block" in the correct positions
-	for (int k = byte_start; k < JBOD_BLOCK_SIZE; k++){
-	  write_block[k] = buf[len-bytes_left];
-	  bytes_left -= 1;
-	  // stops looping if there are no bytes left
-	  if (bytes_left == 0){
-	    break;
-	  }
-	}
-	// writes "write_block" to the current block
-	result = jbod_client_operation(JBOD_WRITE_BLOCK << 12, write_block);
-	if (result == -1){
-	  return -1;
-	}
-	// inserts "write_block" into the cache
-	cache_insert(i, j, write_block);
-	// stops writing if there are no bytes left
-	if (bytes_left == 0){
-	  return len;
+	memcpy(&req->buf[pos], &s->b.new_block[byte_start], n);
+      }
+      pos += n;
+    }
+    req->result = req->len;
+    any_write |= req->write;
+  }
+  if (any_write && store_staged() == -1){
+    for (int i = 0; i < taken; i++){
+      if (reqs[i].write){
+	reqs[i].result = -1;
+      }
+    }
+  }
+  num_passes++;
+  return taken;
+}
+
+int mdadm_submit(int count, mdadm_request_t *reqs) {
+  bool any_read = false, any_write = false;
+  for (int i = 0; i < count; i++){
+    mdadm_request_t *req = &reqs[i];
+    // the checks mdadm_read and mdadm_write make
+    if (req->len > 2048 || (uint64_t)req->addr + req->len > mdadm_capacity() || (req->buf == NULL && req->len > 0)){
+      req->result = -1;
+      continue;
+    }
+    req->result = 0;
+    any_read |= !req->write;
+    any_write |= req->write;
+  }
+  // mounting and granting write permission fail once they are done, which
+  // the requests rely on; one probe of each serves the whole batch
+  bool reads_ok = !any_read || mdadm_mount() == -1;
+  bool writes_ok = !any_write || mdadm_write_permission() == -1;
+  for (int i = 0; i < count; i++){
+    if ((reqs[i].write && !writes_ok) || (!reqs[i].write && !reads_ok)){
+      reqs[i].result = -1;
+    }
+  }
+  num_requests += count;
+  int done = 0;
+  while (done < count){
+    done += submit_pass(count - done, &reqs[done]);
+  }
+  int num_ok = 0;
+  for (int i = 0; i < count; i++){
+    if (reqs[i].result != -1){
+      num_ok++;
+    }
+  }
+  return num_ok;
+}
+
+int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf) {
+  mdadm_request_t req = {.write = false, .addr = addr, .len = len, .buf = buf};
+  mdadm_submit(1, &req);
+  return req.result;
+}
+
+int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf) {
+  mdadm_request_t req = {.write = true, .addr = addr, .len = len, .buf = (uint8_t *)buf};
+  mdadm_submit(1, &req);
+  return req.result;
+}
+
+int mdadm_fail_disk(int disk_num) {
+  // only the RAID-5 layout can lose a disk, and only one at a time
+  if (layout != MDADM_RAID5 || !mounted || failed_disk != -1 || disk_num < 0 || disk_num >= geometry.num_disks){
+    return -1;
+  }
+  failed_disk = disk_num;
+  return 1;
+}
+
+int mdadm_rebuild(void) {
+  if (failed_disk == -1 || mdadm_write_permission() != -1){
+    return -1;
+  }
+  uint8_t block[JBOD_BLOCK_SIZE];
+  // reconstructs every block of the failed disk from the other disks, never
+  // from the cache, writes it back in place and refreshes any cached copy
+  for (int j = 0; j < geometry.blocks_per_disk; j++){
+    if (reconstruct_block(j, block) == -1 || store_block(failed_disk, j, block) == -1){
+      return -1;
+    }
+    cache_update(failed_disk, j, block);
+  }
+  failed_disk = -1;
+  return 1;
+}
+
+int mdadm_resync(void) {
+  if (layout != MDADM_RAID5 || failed_disk != -1 || mdadm_write_permission() != -1){
+    return -1;
+  }
+  uint8_t blocks[geometry.num_disks - 1][JBOD_BLOCK_SIZE];
+  uint8_t *bufs[geometry.num_disks - 1];
+  uint8_t parity_block[JBOD_BLOCK_SIZE];
+  uint8_t *parity_buf = parity_block;
+  int disk_nums[geometry.num_disks - 1], block_nums[geometry.num_disks - 1];
+  // recomputes every parity block from the data blocks beside it
+  for (int j = 0; j < geometry.blocks_per_disk; j++){
+    int parity = parity_disk(j);
+    int count = 0;
+    for (int i = 0; i < geometry.num_disks; i++){
+      if (i != parity){
+	disk_nums[count] = i;
+	block_nums[count] = j;
+	bufs[count] = blocks[count];
+	count++;
+      }
+    }
+    if (read_blocks(count, disk_nums, block_nums, bufs) == -1){
+      return -1;
+    }
+    memset(parity_block, 0, JBOD_BLOCK_SIZE);
+    for (int i = 0; i < count; i++){
+      xor_block(parity_block, blocks[i], JBOD_BLOCK_SIZE);
+    }
+    if (write_blocks(1, &parity, &j, &parity_buf) == -1){
+      return -1;
+    }
+  }
+  return 1;
+}
+
+/* reads |count| consecutive blocks of |disk_num| from the disk itself,
+ * bypassing the cache, with the reads merged into one pipelined run;
+ * returns 0 on success and -1 on failure */
+static int read_run(int disk_num, int block_num, int count, uint8_t *blocks) {
+  for (int i = 0; i < count; i++){
+    if (sched_read(disk_num, block_num + i, &blocks[i * JBOD_BLOCK_SIZE]) == -1){
+      return -1;
+    }
+  }
+  if (sched_flush() == -1){
+    return -1;
+  }
+  num_block_reads += count;
+  return 0;
+}
+
+int mdadm_scrub(bool incremental) {
+  if (!mounted){
+    return -1;
+  }
+  static uint8_t blocks[MDADM_SCRUB_RUN * JBOD_BLOCK_SIZE];
+  int mismatches = 0;
+  for (int i = 0; i < geometry.num_disks; i++){
+    // the failed disk has nothing to check until it is rebuilt
+    if (i == failed_disk){
+      continue;
+    }
+    int j = 0;
+    while (j < geometry.blocks_per_disk){
+      // finds the next run of blocks to check, all of them unless incremental
+      uint32_t index = block_index(i, j);
+      if (incremental && !block_dirty[index]){
+	j++;
+	continue;
+      }
+      int count = 1;
+      while (j + count < geometry.blocks_per_disk && count < MDADM_SCRUB_RUN &&
+	     (!incremental || block_dirty[index + count])){
+	count++;
+      }
+      if (read_run(i, j, count, blocks) == -1){
+	return -1;
+      }
+      // compares every block against its expected checksum and records it
+      for (int k = 0; k < count; k++){
+	uint32_t sum = crc32c(&blocks[k * JBOD_BLOCK_SIZE], JBOD_BLOCK_SIZE);
+	if (block_sum_known[index + k] && block_sums[index + k] != sum){
+	  mismatches++;
 	}
+	block_sums[index + k] = sum;
+	block_sum_known[index + k] = true;
+	block_dirty[index + k] = false;
       }
+      num_scrubbed_blocks += count;
+      j += count;
     }
-    return len;
-  } else {
+  }
+  num_scrub_mismatches += mismatches;
+  return mismatches;
+}
+
+int mdadm_snapshot_create(void) {
+  if (!mounted){
     return -1;
   }
+  return snap_create(mdadm_capacity() / JBOD_BLOCK_SIZE);
+}
+
+int mdadm_snapshot_release(int gen) {
+  return snap_release(gen);
+}
+
+int mdadm_snapshot_read(int gen, uint32_t addr, uint32_t len, uint8_t *buf) {
+  if (!mounted || !snap_exists(gen) || (uint64_t)addr + len > mdadm_capacity() || (buf == NULL && len > 0)){
+    return -1;
+  }
+  static uint8_t blocks[MDADM_SCRUB_RUN][JBOD_BLOCK_SIZE];
+  uint8_t *bufs[MDADM_SCRUB_RUN];
+  int disk_nums[MDADM_SCRUB_RUN], block_nums[MDADM_SCRUB_RUN];
+  uint32_t pos = 0;
+  while (pos < len){
+    // resolves up to MDADM_SCRUB_RUN blocks at a time, the ones the snapshot
+    // shares with the live array are read together like in mdadm_read
+    uint32_t first = (addr + pos) / JBOD_BLOCK_SIZE;
+    uint32_t last = (addr + len - 1) / JBOD_BLOCK_SIZE;
+    int count = last - first + 1 > MDADM_SCRUB_RUN ? MDADM_SCRUB_RUN : last - first + 1;
+    int num_live = 0;
+    for (int i = 0; i < count; i++){
+      if (snap_lookup(gen, first + i, blocks[i])){
+	num_snapshot_reads++;
+	continue;
+      }
+      map_block(first + i, &disk_nums[num_live], &block_nums[num_live]);
+      bufs[num_live++] = blocks[i];
+    }
+    if (num_live > 0 && read_blocks(num_live, disk_nums, block_nums, bufs) == -1){
+      return -1;
+    }
+    // copies the requested part of the blocks into "buf"
+    for (int i = 0; i < count && pos < len; i++){
+      uint32_t byte_start = (addr + pos) % JBOD_BLOCK_SIZE;
+      uint32_t n = JBOD_BLOCK_SIZE - byte_start;
+      if (n > len - pos){
+	n = len - pos;
+      }
+      memcpy(&buf[pos], &blocks[i][byte_start], n);
+      pos += n;
+    }
+  }
+  return len;
+}
+
+void mdadm_print_stats(void) {
+  fprintf(stderr, "requests: %d in %d batches\n", num_requests, num_passes);
+  fprintf(stderr, "block reads: %d, block writes: %d\n", num_block_reads, num_block_writes);
+  fprintf(stderr, "unchanged block writes skipped: %d (%d bytes)\n", num_skipped_writes, num_skipped_writes * JBOD_BLOCK_SIZE);
+  if (layout == MDADM_RAID5){
+    fprintf(stderr, "parity updates: %d read-modify-write, %d reconstruct-write, %d full stripe\n",
+	    num_rmw_writes, num_reconstruct_writes, num_full_stripe_writes);
+    fprintf(stderr, "degraded reads: %d\n", num_degraded_reads);
+  }
+  if (num_scrubbed_blocks > 0){
+    fprintf(stderr, "scrubbed blocks: %d, checksum mismatches: %d\n", num_scrubbed_blocks, num_scrub_mismatches);
+  }
+  if (num_snapshot_copies > 0 || num_snapshot_reads > 0){
+    fprintf(stderr, "copy-on-write copies: %d, snapshot blocks read from the store: %d\n",
+	    num_snapshot_copies, num_snapshot_reads);
+  }
 }
@@ -5,6 +5,30 @@
 #include "jbod.h"
 #include "cache.h"
 
+typedef enum {
+  MDADM_LINEAR,   /* each disk holds a contiguous 64 KB of the address space */
+  MDADM_STRIPED,  /* stripe units rotate across the disks (RAID-0) */
+  MDADM_RAID5,    /* striped with one rotating parity unit per row */
+} mdadm_layout_t;
+
+/* Return 1 on success and -1 on failure. Selects how addresses are mapped
+ * onto the disks from the next mount on, so it fails while mounted.
+ * |stripe_blocks| is the number of consecutive blocks kept on one disk
+ * before moving to the next; it must be a power of two that divides the
+ * number of blocks per disk and is ignored by the linear layout. RAID-5
+ * needs at least three disks. */
+int mdadm_set_layout(mdadm_layout_t layout, int stripe_blocks);
+
+/* Return 1 on success and -1 on failure. Sets the number of disks and of
+ * blocks per disk, JBOD_NUM_DISKS and JBOD_NUM_BLOCKS_PER_DISK until then,
+ * from the next mount on, so it fails while mounted. The server needs at
+ * least that many disks and blocks and the op layout of geometry_set; a
+ * stock server fits any geometry up to the default. */
+int mdadm_set_geometry(int num_disks, int blocks_per_disk);
+
+/* Returns the number of addressable bytes in the current layout. */
+uint32_t mdadm_capacity(void);
+
 /* Return 1 on success and -1 on failure */
 int mdadm_mount(void);
 
@@ -23,4 +47,59 @@ int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf);
 /* Return the number of bytes written on success, -1 on failure. */
 int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf);
 
+/* one read or write of a batch given to mdadm_submit */
+typedef struct {
+  bool write;
+  uint32_t addr;
+  uint32_t len;         /* at most 2048 bytes, like mdadm_read and mdadm_write */
+  uint8_t *buf;         /* where a read lands or what a write stores */
+  int result;           /* set to what mdadm_read or mdadm_write would return */
+} mdadm_request_t;
+
+/* Returns the number of requests that succeeded and sets the result of
+ * each. Runs the |count| requests at |reqs| as if one after the other, so a
+ * read sees the writes before it, but reads all the blocks they need before
+ * any of them and writes what they changed after the last, up to
+ * SCHED_QUEUE_DEPTH blocks at a time, so that the scheduler can order the
+ * blocks of many requests in one sweep. */
+int mdadm_submit(int count, mdadm_request_t *reqs);
+
+/* Return 1 on success and -1 on failure. Marks |disk_num| as failed in the
+ * RAID-5 layout: its blocks are reconstructed from the other disks on read
+ * and only folded into the parity on write. */
+int mdadm_fail_disk(int disk_num);
+
+/* Return 1 on success and -1 on failure. Reconstructs every block of the
+ * failed disk, writes it back and returns the array to normal operation. */
+int mdadm_rebuild(void);
+
+/* Return 1 on success and -1 on failure. Recomputes all RAID-5 parity from
+ * the data, e.g. after mounting disks whose parity was never written. */
+int mdadm_resync(void);
+
+/* Returns the number of blocks whose CRC32C no longer matches the contents
+ * last written or scrubbed, and -1 on failure. Reads the disks directly, in
+ * pipelined runs, and records the checksums for the next scrub. When
+ * |incremental| is true, only the blocks written since the last scrub are
+ * checked. */
+int mdadm_scrub(bool incremental);
+
+/* Returns the generation of a new point-in-time snapshot of the array, or
+ * -1 on failure. Nothing is copied up front: the first write to a block
+ * after the snapshot keeps its old contents in memory for the snapshot. */
+int mdadm_snapshot_create(void);
+
+/* Return the number of bytes read on success, -1 on failure. Reads the
+ * array as it was when snapshot |gen| was taken; unlike mdadm_read, |len|
+ * is not limited to 2048 bytes, so a backup can stream the whole array. */
+int mdadm_snapshot_read(int gen, uint32_t addr, uint32_t len, uint8_t *buf);
+
+/* Return 1 on success and -1 on failure. Drops snapshot |gen| and the
+ * blocks preserved only for it. Changing the layout or the geometry drops
+ * every snapshot. */
+int mdadm_snapshot_release(int gen);
+
+/* Prints the block, seek, parity update and scrub counts. */
+void mdadm_print_stats(void);
+
 #endif
@@ -0,0 +1,577 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <endian.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "cache.h"
+#include "jbod.h"
+#include "mdadm.h"
+#include "net.h"
+#include "sched.h"
+#include "vcache.h"
+
+/* Serves the array over the NBD protocol (fixed newstyle handshake), so
+ * standard clients such as qemu-nbd, nbd-client or fio's nbd engine can
+ * use it as a block device. Requests are answered in order, but clients
+ * may keep many in flight: the requests already received run as one
+ * mdadm_submit batch and their replies go out together. */
+
+#define NBD_ARGUMENTS "hp:U:s:c:v:f:u:r:g:z"
+#define USAGE                                                           \
+  "USAGE: mdadm_nbd [-h] [-p port | -U socket_path] [-s server_port] [-c cache_size]\n" \
+  "                 [-v victim_blocks [-f victim_file]]\n"             \
+  "                 [-u stripe_blocks] [-r stripe_blocks] [-g disks,blocks] [-z]\n" \
+  "\n"                                                                  \
+  "where:\n"                                                            \
+  "    -h - help mode (display this message)\n"                         \
+  "    -p - loopback port to accept NBD clients on (default 10809)\n"   \
+  "    -U - accept NBD clients on a Unix socket at socket_path instead\n" \
+  "    -s - port of the JBOD server (or a jbod_relay) on this host (default 3333)\n" \
+  "    -c - cache cache_size blocks\n"                                  \
+  "    -v - keep victim_blocks blocks evicted from the cache in a file\n" \
+  "    -f - the victim cache file (default: an unlinked temporary file)\n" \
+  "    -u - stripe the array in units of stripe_blocks\n"               \
+  "    -r - use RAID-5 in units of stripe_blocks\n"                     \
+  "    -g - use disks disks of blocks blocks each\n"                    \
+  "    -z - ask the server for compressed frames\n"                     \
+  "\n"                                                                  \
+
+#define NBD_PORT 10809
+
+/* handshake */
+#define NBD_MAGIC 0x4e42444d41474943ULL          /* "NBDMAGIC" */
+#define NBD_OPTS_MAGIC 0x49484156454f5054ULL     /* "IHAVEOPT" */
+#define NBD_REP_MAGIC 0x0003e889045565a9ULL
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES (1 << 1)
+
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT 2
+#define NBD_OPT_LIST 3
+#define NBD_OPT_INFO 6
+#define NBD_OPT_GO 7
+
+#define NBD_REP_ACK 1
+#define NBD_REP_SERVER 2
+#define NBD_REP_INFO 3
+#define NBD_REP_ERR_UNSUP 0x80000001
+#define NBD_REP_ERR_INVALID 0x80000003
+
+#define NBD_INFO_EXPORT 0
+#define NBD_INFO_BLOCK_SIZE 3
+
+/* transmission */
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC 0x67446698
+#define NBD_FLAG_HAS_FLAGS (1 << 0)
+#define NBD_FLAG_SEND_FLUSH (1 << 2)
+
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_FLUSH 3
+
+#define NBD_EIO 5
+#define NBD_EINVAL 22
+#define NBD_ENOSPC 28
+
+/* the largest read or write a client may send, advertised as the maximum
+ * block size, and the payload one batch may carry; reads and writes are
+ * split into 2048-byte mdadm requests like any other */
+#define NBD_MAX_REQUEST (1 << 25)
+
+/* a client connection with buffered input and output, so that pipelined
+ * requests take few system calls and their replies go out together */
+typedef struct {
+  int sd;
+  uint8_t in[64 * 1024];
+  int in_pos;
+  int in_len;
+  uint8_t out[64 * 1024];
+  int out_len;
+} nbd_conn_t;
+
+/* counters printed when a client disconnects */
+static int num_reads = 0;
+static int num_writes = 0;
+static int num_flushes = 0;
+static int num_errors = 0;
+static uint64_t bytes_read = 0;
+static uint64_t bytes_written = 0;
+
+static bool conn_flush(nbd_conn_t *c) {
+  int pos = 0;
+  while (pos < c->out_len) {
+    int n = write(c->sd, &c->out[pos], c->out_len - pos);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    pos += n;
+  }
+  c->out_len = 0;
+  return true;
+}
+
+static bool conn_write(nbd_conn_t *c, const void *buf, int len) {
+  const uint8_t *p = buf;
+  // large payloads skip the buffer
+  if (len > (int)sizeof(c->out)) {
+    if (!conn_flush(c))
+      return false;
+    int pos = 0;
+    while (pos < len) {
+      int n = write(c->sd, &p[pos], len - pos);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      pos += n;
+    }
+    return true;
+  }
+  if (c->out_len + len > (int)sizeof(c->out) && !conn_flush(c))
+    return false;
+  memcpy(&c->out[c->out_len], buf, len);
+  c->out_len += len;
+  return true;
+}
+
+static bool conn_read(nbd_conn_t *c, void *buf, int len) {
+  uint8_t *p = buf;
+  while (len > 0) {
+    if (c->in_pos == c->in_len) {
+      // everything received so far is answered, so the client is waiting
+      if (!conn_flush(c))
+        return false;
+      int n = read(c->sd, c->in, sizeof(c->in));
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      c->in_pos = 0;
+      c->in_len = n;
+    }
+    int n = c->in_len - c->in_pos;
+    if (n > len)
+      n = len;
+    memcpy(p, &c->in[c->in_pos], n);
+    c->in_pos += n;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool put16(nbd_conn_t *c, uint16_t v) {
+  v = htobe16(v);
+  return conn_write(c, &v, sizeof(v));
+}
+
+static bool put32(nbd_conn_t *c, uint32_t v) {
+  v = htobe32(v);
+  return conn_write(c, &v, sizeof(v));
+}
+
+static bool put64(nbd_conn_t *c, uint64_t v) {
+  v = htobe64(v);
+  return conn_write(c, &v, sizeof(v));
+}
+
+static bool get16(nbd_conn_t *c, uint16_t *v) {
+  if (!conn_read(c, v, sizeof(*v)))
+    return false;
+  *v = be16toh(*v);
+  return true;
+}
+
+static bool get32(nbd_conn_t *c, uint32_t *v) {
+  if (!conn_read(c, v, sizeof(*v)))
+    return false;
+  *v = be32toh(*v);
+  return true;
+}
+
+static bool get64(nbd_conn_t *c, uint64_t *v) {
+  if (!conn_read(c, v, sizeof(*v)))
+    return false;
+  *v = be64toh(*v);
+  return true;
+}
+
+static bool put_reply(nbd_conn_t *c, uint32_t opt, uint32_t type, uint32_t len) {
+  return put64(c, NBD_REP_MAGIC) && put32(c, opt) && put32(c, type) && put32(c, len);
+}
+
+/* answers NBD_OPT_INFO and NBD_OPT_GO with the export size and the block
+ * sizes; returns false if the connection failed */
+static bool send_info(nbd_conn_t *c, uint32_t opt) {
+  return put_reply(c, opt, NBD_REP_INFO, 12) && put16(c, NBD_INFO_EXPORT) &&
+    put64(c, mdadm_capacity()) && put16(c, NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH) &&
+    put_reply(c, opt, NBD_REP_INFO, 14) && put16(c, NBD_INFO_BLOCK_SIZE) &&
+    put32(c, 1) && put32(c, JBOD_BLOCK_SIZE) && put32(c, NBD_MAX_REQUEST) &&
+    put_reply(c, opt, NBD_REP_ACK, 0);
+}
+
+/* runs the fixed newstyle handshake; returns true once the client chose the
+ * export and the transmission phase starts */
+static bool handshake(nbd_conn_t *c) {
+  uint32_t client_flags;
+  if (!put64(c, NBD_MAGIC) || !put64(c, NBD_OPTS_MAGIC) ||
+      !put16(c, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES) ||
+      !conn_flush(c) || !get32(c, &client_flags))
+    return false;
+  for (;;) {
+    uint64_t magic;
+    uint32_t opt, len;
+    if (!get64(c, &magic) || magic != NBD_OPTS_MAGIC || !get32(c, &opt) || !get32(c, &len))
+      return false;
+    // the only export is the whole array, so its name does not matter
+    if (len > 4096)
+      return false;
+    uint8_t *data = malloc(len + 1);
+    if (data == NULL || !conn_read(c, data, len)) {
+      free(data);
+      return false;
+    }
+    free(data);
+    bool ok;
+    switch (opt) {
+      case NBD_OPT_EXPORT_NAME:
+        if (!put64(c, mdadm_capacity()) || !put16(c, NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH))
+          return false;
+        if (!(client_flags & NBD_FLAG_NO_ZEROES)) {
+          uint8_t zeroes[124] = {0};
+          if (!conn_write(c, zeroes, sizeof(zeroes)))
+            return false;
+        }
+        return conn_flush(c);
+      case NBD_OPT_ABORT:
+        put_reply(c, opt, NBD_REP_ACK, 0);
+        conn_flush(c);
+        return false;
+      case NBD_OPT_LIST:
+        ok = put_reply(c, opt, NBD_REP_SERVER, 4) && put32(c, 0) && put_reply(c, opt, NBD_REP_ACK, 0);
+        break;
+      case NBD_OPT_INFO:
+      case NBD_OPT_GO:
+        if (len < 6) {
+          ok = put_reply(c, opt, NBD_REP_ERR_INVALID, 0);
+          break;
+        }
+        if (!send_info(c, opt))
+          return false;
+        if (opt == NBD_OPT_GO)
+          return conn_flush(c);
+        ok = true;
+        break;
+      default:
+        ok = put_reply(c, opt, NBD_REP_ERR_UNSUP, 0);
+        break;
+    }
+    if (!ok || !conn_flush(c))
+      return false;
+  }
+}
+
+/* returns the length of the next mdadm call at |addr|, at most 2048 bytes
+ * and ending on a block boundary so the following calls start on one */
+static uint32_t chunk_len(uint64_t addr, uint32_t left) {
+  uint32_t n = 2048 - addr % JBOD_BLOCK_SIZE;
+  return n < left ? n : left;
+}
+
+/* requests read while more of the pipeline is already buffered run as one
+ * mdadm_submit batch, so the scheduler sees the blocks of all of them */
+#define NBD_MAX_BATCH 256
+/* a request of |len| bytes takes at most len / 2048 + 2 chunks */
+#define NBD_MAX_CHUNKS (NBD_MAX_REQUEST / 2048 + 2 * NBD_MAX_BATCH)
+
+typedef struct {
+  uint16_t type;
+  uint64_t handle;
+  uint32_t len;
+  uint32_t error;
+  uint8_t *data;        /* the payload in the batch buffer */
+  int first_chunk;
+  int num_chunks;
+} nbd_request_t;
+
+static nbd_request_t batch[NBD_MAX_BATCH];
+static mdadm_request_t chunks[NBD_MAX_CHUNKS];
+static uint8_t batch_buf[NBD_MAX_REQUEST];
+static int batch_count = 0;
+static int batch_chunks = 0;
+static uint32_t batch_used = 0;
+
+/* splits a read or write of |req| at |addr| into mdadm-sized chunks */
+static void add_chunks(nbd_request_t *req, uint64_t addr) {
+  for (uint32_t pos = 0; pos < req->len; ) {
+    mdadm_request_t *chunk = &chunks[batch_chunks++];
+    chunk->write = req->type == NBD_CMD_WRITE;
+    chunk->addr = addr + pos;
+    chunk->len = chunk_len(addr + pos, req->len - pos);
+    chunk->buf = &req->data[pos];
+    pos += chunk->len;
+  }
+  req->num_chunks = batch_chunks - req->first_chunk;
+}
+
+/* runs the batch and queues its replies in order; returns false if the
+ * connection failed */
+static bool run_batch(nbd_conn_t *c) {
+  bool ok = true;
+  mdadm_submit(batch_chunks, chunks);
+  for (int i = 0; i < batch_count; i++) {
+    nbd_request_t *req = &batch[i];
+    for (int j = req->first_chunk; j < req->first_chunk + req->num_chunks && req->error == 0; j++) {
+      if (chunks[j].result != (int)chunks[j].len)
+        req->error = NBD_EIO;
+    }
+    if (req->type == NBD_CMD_READ) {
+      num_reads++;
+      if (req->error == 0)
+        bytes_read += req->len;
+    } else if (req->type == NBD_CMD_WRITE) {
+      num_writes++;
+      if (req->error == 0)
+        bytes_written += req->len;
+    } else if (req->type == NBD_CMD_FLUSH) {
+      num_flushes++;
+    }
+    if (req->error != 0)
+      num_errors++;
+    ok = ok && put32(c, NBD_SIMPLE_REPLY_MAGIC) && put32(c, req->error) &&
+         conn_write(c, &req->handle, sizeof(req->handle));
+    if (ok && req->type == NBD_CMD_READ && req->error == 0)
+      ok = conn_write(c, req->data, req->len);
+  }
+  batch_count = 0;
+  batch_chunks = 0;
+  batch_used = 0;
+  return ok;
+}
+
+/* answers requests until the client disconnects or the connection fails */
+static void transmit(nbd_conn_t *c) {
+  for (;;) {
+    uint32_t magic, len;
+    uint16_t flags, type;
+    uint64_t handle, offset;
+    if (!get32(c, &magic) || magic != NBD_REQUEST_MAGIC || !get16(c, &flags) ||
+        !get16(c, &type) || !conn_read(c, &handle, sizeof(handle)) ||
+        !get64(c, &offset) || !get32(c, &len)) {
+      // the writes already read are still carried out
+      run_batch(c);
+      return;
+    }
+    // the payload follows a write even when it cannot be written
+    if (type == NBD_CMD_WRITE && len > NBD_MAX_REQUEST) {
+      run_batch(c);
+      return;
+    }
+    bool in_range = len <= NBD_MAX_REQUEST && offset <= mdadm_capacity() && len <= mdadm_capacity() - offset;
+    uint32_t size = type == NBD_CMD_WRITE || (type == NBD_CMD_READ && in_range) ? len : 0;
+    if ((batch_count == NBD_MAX_BATCH || batch_used + size > NBD_MAX_REQUEST) && !run_batch(c))
+      return;
+    nbd_request_t *req = &batch[batch_count++];
+    req->type = type;
+    req->handle = handle;
+    req->len = len;
+    req->error = 0;
+    req->data = &batch_buf[batch_used];
+    req->first_chunk = batch_chunks;
+    req->num_chunks = 0;
+    batch_used += size;
+    switch (type) {
+      case NBD_CMD_READ:
+        if (!in_range)
+          req->error = NBD_EINVAL;
+        else
+          add_chunks(req, offset);
+        break;
+      case NBD_CMD_WRITE:
+        if (!conn_read(c, req->data, len)) {
+          batch_count--;
+          run_batch(c);
+          return;
+        }
+        if (!in_range)
+          req->error = NBD_ENOSPC;
+        else
+          add_chunks(req, offset);
+        break;
+      case NBD_CMD_FLUSH:
+        // the cache writes through and the batch's writes reach the server
+        // before any reply goes out, so there is nothing left to flush
+        break;
+      case NBD_CMD_DISC:
+        batch_count--;
+        run_batch(c);
+        conn_flush(c);
+        return;
+      default:
+        req->error = NBD_EINVAL;
+        break;
+    }
+    // a drained pipeline means the client waits for these replies
+    if (c->in_pos == c->in_len && !run_batch(c))
+      return;
+  }
+}
+
+static void serve(int sd) {
+  static nbd_conn_t conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.sd = sd;
+  if (handshake(&conn))
+    transmit(&conn);
+  fprintf(stderr, "nbd: %d reads (%llu bytes), %d writes (%llu bytes), %d flushes, %d errors\n",
+          num_reads, (unsigned long long)bytes_read, num_writes, (unsigned long long)bytes_written,
+          num_flushes, num_errors);
+  cache_print_hit_rate();
+  mdadm_print_stats();
+  sched_print_stats();
+}
+
+static int listen_tcp(int port) {
+  int lsd = socket(AF_INET, SOCK_STREAM, 0);
+  if (lsd == -1)
+    err(1, "socket");
+  int one = 1;
+  setsockopt(lsd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(lsd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(lsd, 1) == -1)
+    err(1, "cannot listen on port %d", port);
+  return lsd;
+}
+
+static int listen_unix(const char *path) {
+  int lsd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (lsd == -1)
+    err(1, "socket");
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    errx(1, "socket path %s is too long", path);
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(lsd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(lsd, 1) == -1)
+    err(1, "cannot listen on %s", path);
+  return lsd;
+}
+
+int main(int argc, char *argv[])
+{
+  int ch, port = NBD_PORT, server_port = JBOD_PORT, cache_size = 0, victim_size = 0;
+  int num_disks = JBOD_NUM_DISKS, blocks_per_disk = JBOD_NUM_BLOCKS_PER_DISK;
+  mdadm_layout_t layout = MDADM_LINEAR;
+  char *stripe_blocks = "1", *socket_path = NULL, *victim_path = NULL;
+  bool compress = false;
+
+  while ((ch = getopt(argc, argv, NBD_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'U':
+        socket_path = optarg;
+        break;
+      case 's':
+        server_port = atoi(optarg);
+        break;
+      case 'c':
+        cache_size = atoi(optarg);
+        break;
+      case 'v':
+        victim_size = atoi(optarg);
+        break;
+      case 'f':
+        victim_path = optarg;
+        break;
+      case 'u':
+        layout = MDADM_STRIPED;
+        stripe_blocks = optarg;
+        break;
+      case 'r':
+        layout = MDADM_RAID5;
+        stripe_blocks = optarg;
+        break;
+      case 'g':
+        if (sscanf(optarg, "%d,%d", &num_disks, &blocks_per_disk) != 2) {
+          fprintf(stderr, "Invalid geometry %s, aborting.\n", optarg);
+          return -1;
+        }
+        break;
+      case 'z':
+        compress = true;
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return -1;
+    }
+  }
+
+  if (mdadm_set_geometry(num_disks, blocks_per_disk) != 1) {
+    fprintf(stderr, "Invalid geometry %d,%d, aborting.\n", num_disks, blocks_per_disk);
+    return -1;
+  }
+  if (mdadm_set_layout(layout, atoi(stripe_blocks)) != 1) {
+    fprintf(stderr, "Invalid stripe unit %s, aborting.\n", stripe_blocks);
+    return -1;
+  }
+  if (cache_size && cache_create(cache_size) != 1)
+    errx(1, "Failed to create cache.");
+  if (victim_size && (!cache_size || vcache_create(victim_path, victim_size) != 1))
+    errx(1, "Failed to create victim cache.");
+
+  int lsd = socket_path ? listen_unix(socket_path) : listen_tcp(port);
+
+  if (!jbod_connect(JBOD_SERVER, server_port))
+    errx(1, "cannot connect to the JBOD server on port %d.", server_port);
+  if (compress && !jbod_negotiate_compression())
+    fprintf(stderr, "Server does not support compression, continuing without.\n");
+  // an earlier client of the server may have left the array mounted and
+  // writable, which makes mounting fail, so it starts from scratch
+  mdadm_revoke_write_permission();
+  mdadm_unmount();
+  if (mdadm_mount() != 1 || mdadm_write_permission() != 1)
+    errx(1, "cannot mount the array.");
+  // nothing guarantees the disks hold valid parity, and a rebuild from
+  // stale parity would hand the client garbage
+  if (layout == MDADM_RAID5 && mdadm_resync() != 1)
+    errx(1, "cannot resync the RAID-5 parity.");
+
+  // serves one client at a time; its requests may be pipelined
+  for (;;) {
+    int sd = accept(lsd, NULL, NULL);
+    if (sd == -1)
+      continue;
+    // replies are already batched, so they need not wait for more data
+    int one = 1;
+    if (!socket_path)
+      setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    serve(sd);
+    close(sd);
+  }
+  return 0;
+}
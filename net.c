@@ -8,12 +8,32 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "geometry.h"
 #include "net.h"
 #include "jbod.h"
+#include "lz.h"
 
 /* the client socket descriptor for the connection to the server */
 int cli_sd = -1;
 
+/* whether requests and responses travel in compressed frames, which is
+negotiated by jbod_negotiate_compression */
+static bool compress_frames = false;
+
+/* frames shorter than a block are mostly headers and are never compressed,
+and frames that would not compress let the following ones skip the attempt */
+#define FRAME_MIN_COMPRESS JBOD_BLOCK_SIZE
+#define FRAME_BYPASS_STREAK 4
+#define FRAME_BYPASS_COUNT 16
+static int incompressible_streak = 0;
+static int bypass_frames = 0;
+
+/* bytes carried by frames before and after compression, headers included */
+static uint64_t frame_raw_bytes = 0;
+static uint64_t frame_wire_bytes = 0;
+
 /* attempts to read n (len) bytes from fd; returns true on success and false on failure. 
 It may need to call the system call "read" multiple times to reach the given size len. 
 */
@@ -24,7 +44,8 @@ static bool nread(int fd, int len, uint8_t *buf) {
   // reads from fd until all of the bytes are read
   while (read_len != 0){
     temp = read(fd, &buf[pos], read_len);
-    if (temp == -1){
+    // a closed connection reads as 0 bytes
+    if (temp <= 0){
       return false;
     }
     read_len -= temp;
@@ -89,17 +110,9 @@ static bool recv_packet(int sd, uint32_t *op, uint8_t *ret, uint8_t *block) {
 
 
 
-/* The client attempts to send a jbod request packet to sd (i.e., the server socket here); 
-returns true on success and false on failure. 
-
-op - the opcode. 
-block- when the command is JBOD_WRITE_BLOCK, the block will contain data to write to the server jbod system;
-otherwise it is NULL.
-
-The above information (when applicable) has to be wrapped into a jbod request packet (format specified in readme).
-You may call the above nwrite function to do the actual sending.  
-*/
-static bool send_packet(int sd, uint32_t op, uint8_t *block) {
+/* fills |buf| with the request packet for |op| and |block| (see send_packet
+below) and returns its length; |buf| must hold HEADER_LEN + JBOD_BLOCK_SIZE bytes */
+static int pack_packet(uint32_t op, uint8_t *block, uint8_t *buf) {
   int buf_len;
   uint8_t op_bytes[4];
   op_bytes[3] = op & 0xFF;
@@ -112,7 +125,6 @@ static bool send_packet(int sd, uint32_t op, uint8_t *block) {
   } else{
     buf_len = HEADER_LEN;
   }
-  uint8_t buf[buf_len];
   // copies the bytes of op into the buf
   for (int i=0; i<4; i++){
     buf[i] = op_bytes[i];
@@ -126,6 +138,22 @@ static bool send_packet(int sd, uint32_t op, uint8_t *block) {
   } else{
     buf[4] = 0;
   }
+  return buf_len;
+}
+
+/* The client attempts to send a jbod request packet to sd (i.e., the server socket here); 
+returns true on success and false on failure. 
+
+op - the opcode. 
+block- when the command is JBOD_WRITE_BLOCK, the block will contain data to write to the server jbod system;
+otherwise it is NULL.
+
+The above information (when applicable) has to be wrapped into a jbod request packet (format specified in readme).
+You may call the above nwrite function to do the actual sending.  
+*/
+static bool send_packet(int sd, uint32_t op, uint8_t *block) {
+  uint8_t buf[HEADER_LEN + JBOD_BLOCK_SIZE];
+  int buf_len = pack_packet(op, block, buf);
   if(nwrite(sd, buf_len, buf) == false){
     return false;
   }
@@ -166,6 +194,7 @@ bool jbod_connect(const char *ip, uint16_t port) {
 void jbod_disconnect(void) {
   close(cli_sd);
   cli_sd = -1;
+  compress_frames = false;
 }
 
 
@@ -177,6 +206,10 @@ The meaning of each parameter is the same as in the original jbod_operation func
 return: 0 means success, -1 means failure.
 */
 int jbod_client_operation(uint32_t op, uint8_t *block) {
+  // a single operation is a one-packet frame on a compressed connection
+  if (compress_frames){
+    return jbod_client_operations(1, &op, block);
+  }
   if (cli_sd != -1){
     // sends the packet
     if (send_packet(cli_sd, op, block) == false){
@@ -195,3 +228,255 @@ int jbod_client_operation(uint32_t op, uint8_t *block) {
   }
   return -1;
 }
+
+
+
+/* acknowledges what sd receives right away; a server answering a batch of
+requests sends its responses back to back and would otherwise wait for the
+delayed acknowledgement of the first one before sending the rest */
+static void quick_ack(int sd) {
+  int one = 1;
+  setsockopt(sd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+}
+
+
+
+/* like jbod_client_operation, but for |count| operations that are sent in
+batches of up to JBOD_PIPELINE_DEPTH requests, each batch in a single write
+and ahead of its responses, so a run of operations pays for one round trip
+per batch instead of one per operation.
+
+ops - the opcodes, executed by the server in order
+blocks - NULL, or count * JBOD_BLOCK_SIZE bytes where the i-th block is the
+payload of the i-th write or receives the result of the i-th read
+return: 0 if every operation succeeded, -1 otherwise. All responses of a
+batch are consumed even after a failure so the connection stays in sync.
+*/
+int jbod_client_operations(int count, const uint32_t *ops, uint8_t *blocks) {
+  if (cli_sd == -1){
+    return -1;
+  }
+  static uint8_t buf[JBOD_FRAME_MAX];
+  int result = 0;
+  for (int first = 0; first < count; first += JBOD_PIPELINE_DEPTH){
+    int batch = count - first;
+    if (batch > JBOD_PIPELINE_DEPTH){
+      batch = JBOD_PIPELINE_DEPTH;
+    }
+    // packs the whole batch of requests and sends it at once
+    int buf_len = 0;
+    for (int i = first; i < first + batch; i++){
+      uint8_t *block = NULL;
+      if (blocks != NULL && geom_op_cmd(ops[i]) == JBOD_WRITE_BLOCK){
+	block = &blocks[i * JBOD_BLOCK_SIZE];
+      }
+      buf_len += pack_packet(ops[i], block, &buf[buf_len]);
+    }
+    if (compress_frames){
+      // the responses come back packed in one frame as well
+      if (jbod_send_frame(cli_sd, buf, buf_len) == false){
+	return -1;
+      }
+      buf_len = jbod_recv_frame(cli_sd, buf, JBOD_FRAME_MAX);
+      int pos = 0;
+      for (int i = first; i < first + batch; i++){
+	if (buf_len - pos < (int)HEADER_LEN){
+	  return -1;
+	}
+	uint8_t ret = buf[pos + 4];
+	pos += HEADER_LEN;
+	if (ret & 2){
+	  if (buf_len - pos < JBOD_BLOCK_SIZE){
+	    return -1;
+	  }
+	  if (blocks != NULL){
+	    memcpy(&blocks[i * JBOD_BLOCK_SIZE], &buf[pos], JBOD_BLOCK_SIZE);
+	  }
+	  pos += JBOD_BLOCK_SIZE;
+	}
+	if (ret & 1){
+	  result = -1;
+	}
+      }
+      continue;
+    }
+    if (nwrite(cli_sd, buf_len, buf) == false){
+      return -1;
+    }
+    for (int i = first; i < first + batch; i++){
+      uint32_t op;
+      uint8_t ret[1];
+      uint8_t scratch[JBOD_BLOCK_SIZE];
+      uint8_t *block = blocks != NULL ? &blocks[i * JBOD_BLOCK_SIZE] : scratch;
+      quick_ack(cli_sd);
+      if (recv_packet(cli_sd, &op, ret, block) == false){
+	return -1;
+      }
+      if (ret[0] & 1){
+	result = -1;
+      }
+    }
+  }
+  return result;
+}
+
+
+
+/* asks the server to switch the connection to compressed frames; returns
+true if it did. A server without compression rejects the unknown command and
+the connection keeps carrying plain packets. */
+bool jbod_negotiate_compression(void) {
+  if (compress_frames || jbod_client_operation(JBOD_NEGOTIATE_COMPRESSION, NULL) == -1){
+    return compress_frames;
+  }
+  compress_frames = true;
+  return true;
+}
+
+
+
+/* the server side of jbod_negotiate_compression: reads the first request
+from sd and acknowledges it if it asks for compressed frames; returns false
+if it was any other request, which is not answered. */
+bool jbod_accept_compression(int sd) {
+  uint8_t header[HEADER_LEN];
+  if (nread(sd, HEADER_LEN, header) == false){
+    return false;
+  }
+  uint32_t op = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+  if (op != JBOD_NEGOTIATE_COMPRESSION || header[4] != 0){
+    return false;
+  }
+  return nwrite(sd, HEADER_LEN, header);
+}
+
+static void put_u32(uint8_t *buf, uint32_t v) {
+  buf[0] = v >> 24;
+  buf[1] = v >> 16;
+  buf[2] = v >> 8;
+  buf[3] = v;
+}
+
+static uint32_t get_u32(const uint8_t *buf) {
+  return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+
+
+/* sends len bytes of packets from buf to sd as one frame: the raw length,
+the compressed length (0 if the frame is stored uncompressed) and the
+payload. Short frames and frames that do not shrink are sent raw, and a streak of them turns
+compression off for the next few frames. Returns true on success. */
+bool jbod_send_frame(int sd, const uint8_t *buf, int len) {
+  static uint8_t frame[JBOD_FRAME_HEADER_LEN + LZ_BOUND(JBOD_FRAME_MAX)];
+  if (len > JBOD_FRAME_MAX){
+    return false;
+  }
+  int comp_len = 0;
+  if (len < FRAME_MIN_COMPRESS){
+    // sent as is
+  } else if (bypass_frames > 0){
+    bypass_frames--;
+  } else {
+    comp_len = lz_compress(buf, len, &frame[JBOD_FRAME_HEADER_LEN]);
+    if (comp_len >= len){
+      comp_len = 0;
+      if (++incompressible_streak == FRAME_BYPASS_STREAK){
+	incompressible_streak = 0;
+	bypass_frames = FRAME_BYPASS_COUNT;
+      }
+    } else {
+      incompressible_streak = 0;
+    }
+  }
+  if (comp_len == 0){
+    memcpy(&frame[JBOD_FRAME_HEADER_LEN], buf, len);
+  }
+  put_u32(frame, len);
+  put_u32(&frame[4], comp_len);
+  int frame_len = JBOD_FRAME_HEADER_LEN + (comp_len ? comp_len : len);
+  frame_raw_bytes += JBOD_FRAME_HEADER_LEN + len;
+  frame_wire_bytes += frame_len;
+  return nwrite(sd, frame_len, frame);
+}
+
+
+
+/* receives one frame sent by jbod_send_frame into buf, which holds cap
+bytes; returns the length of the packets in it, or -1 on failure. */
+int jbod_recv_frame(int sd, uint8_t *buf, int cap) {
+  static uint8_t comp[LZ_BOUND(JBOD_FRAME_MAX)];
+  uint8_t header[JBOD_FRAME_HEADER_LEN];
+  if (nread(sd, JBOD_FRAME_HEADER_LEN, header) == false){
+    return -1;
+  }
+  uint32_t len = get_u32(header);
+  uint32_t comp_len = get_u32(&header[4]);
+  if (len > (uint32_t)cap || comp_len > sizeof(comp)){
+    return -1;
+  }
+  frame_raw_bytes += JBOD_FRAME_HEADER_LEN + len;
+  frame_wire_bytes += JBOD_FRAME_HEADER_LEN + (comp_len ? comp_len : len);
+  if (comp_len == 0){
+    return nread(sd, len, buf) ? (int)len : -1;
+  }
+  if (nread(sd, comp_len, comp) == false || lz_decompress(comp, comp_len, buf, cap) != (int)len){
+    return -1;
+  }
+  return len;
+}
+
+
+
+/* sends len bytes of already packed requests to the server over the client
+connection and collects the response to each of them into resps, which
+holds cap bytes; returns the length of the responses, or -1 on failure.
+This is how a relay hands the contents of a frame to a plain server. */
+int jbod_client_forward(const uint8_t *reqs, int len, uint8_t *resps, int cap) {
+  int count = 0, pos = 0;
+  // counts the requests, each of which has a block only if flagged so
+  while (pos < len){
+    if (len - pos < (int)HEADER_LEN){
+      return -1;
+    }
+    pos += HEADER_LEN + ((reqs[pos + 4] & 2) ? JBOD_BLOCK_SIZE : 0);
+    count++;
+  }
+  if (pos != len || cli_sd == -1 || nwrite(cli_sd, len, (uint8_t *)reqs) == false){
+    return -1;
+  }
+  pos = 0;
+  for (int i = 0; i < count; i++){
+    quick_ack(cli_sd);
+    if (cap - pos < (int)(HEADER_LEN + JBOD_BLOCK_SIZE) || nread(cli_sd, HEADER_LEN, &resps[pos]) == false){
+      return -1;
+    }
+    bool has_block = resps[pos + 4] & 2;
+    pos += HEADER_LEN;
+    if (has_block){
+      if (nread(cli_sd, JBOD_BLOCK_SIZE, &resps[pos]) == false){
+	return -1;
+      }
+      pos += JBOD_BLOCK_SIZE;
+    }
+  }
+  return pos;
+}
+
+
+
+/* returns the number of bytes frames have taken on the wire so far */
+uint64_t jbod_frame_wire_bytes(void) {
+  return frame_wire_bytes;
+}
+
+
+
+/* prints how much the frames were compressed, if any were sent */
+void jbod_print_frame_stats(void) {
+  if (frame_raw_bytes > 0){
+    fprintf(stderr, "frame bytes: %llu raw, %llu on the wire (%5.1f%%)\n",
+	    (unsigned long long)frame_raw_bytes, (unsigned long long)frame_wire_bytes,
+	    100 * (float) frame_wire_bytes / frame_raw_bytes);
+  }
+}
@@ -4,12 +4,31 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "jbod.h"
+
 #define HEADER_LEN (sizeof(uint32_t) + sizeof(uint8_t))
 #define JBOD_SERVER "127.0.0.1"
 #define JBOD_PORT 3333
 
+/* the number of requests jbod_client_operations keeps in flight */
+#define JBOD_PIPELINE_DEPTH 64
+
+/* a compressed frame carries at most one pipelined batch of packets */
+#define JBOD_FRAME_MAX (JBOD_PIPELINE_DEPTH * (HEADER_LEN + JBOD_BLOCK_SIZE))
+#define JBOD_FRAME_HEADER_LEN (2 * sizeof(uint32_t))
+#define JBOD_NEGOTIATE_COMPRESSION (JBOD_NUM_CMDS << 12)
+
 int jbod_client_operation(uint32_t op, uint8_t *block);
+int jbod_client_operations(int count, const uint32_t *ops, uint8_t *blocks);
 bool jbod_connect(const char *ip, uint16_t port);
 void jbod_disconnect(void);
 
+bool jbod_negotiate_compression(void);
+bool jbod_accept_compression(int sd);
+bool jbod_send_frame(int sd, const uint8_t *buf, int len);
+int jbod_recv_frame(int sd, uint8_t *buf, int cap);
+int jbod_client_forward(const uint8_t *reqs, int len, uint8_t *resps, int cap);
+uint64_t jbod_frame_wire_bytes(void);
+void jbod_print_frame_stats(void);
+
 #endif
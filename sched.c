@@ -0,0 +1,137 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "geometry.h"
+#include "jbod.h"
+#include "net.h"
+#include "sched.h"
+#include "util.h"
+
+/* every queued operation may need a disk and a block seek in front of it */
+#define SCHED_MAX_OPS (3 * SCHED_QUEUE_DEPTH)
+
+static sched_op_t queue[SCHED_QUEUE_DEPTH];
+static int queue_len = 0;
+
+/* the disk and block the server will act on with the next read or write
+ * command, or -1 when unknown */
+static int head_disk = -1;
+static int head_block = -1;
+
+/* counters reported by sched_print_stats */
+static int num_ops = 0;
+static int num_runs = 0;
+static int num_seeks = 0;
+static uint64_t server_ns = 0;
+
+static int enqueue(jbod_cmd_t cmd, int disk_num, int block_num, uint8_t *block) {
+  // makes room by sending what is already queued
+  if (queue_len == SCHED_QUEUE_DEPTH && sched_flush() == -1){
+    return -1;
+  }
+  sched_op_t *op = &queue[queue_len];
+  op->cmd = cmd;
+  op->disk_num = disk_num;
+  op->block_num = block_num;
+  op->block = block;
+  op->seq = queue_len;
+  queue_len++;
+  return 0;
+}
+
+int sched_read(int disk_num, int block_num, uint8_t *block) {
+  return enqueue(JBOD_READ_BLOCK, disk_num, block_num, block);
+}
+
+int sched_write(int disk_num, int block_num, const uint8_t *block) {
+  return enqueue(JBOD_WRITE_BLOCK, disk_num, block_num, (uint8_t *)block);
+}
+
+static int compare_ops(const void *a, const void *b) {
+  const sched_op_t *x = a, *y = b;
+  if (x->pos != y->pos){
+    return x->pos < y->pos ? -1 : 1;
+  }
+  return x->seq - y->seq;
+}
+
+int sched_flush(void) {
+  static uint32_t ops[SCHED_MAX_OPS];
+  static uint8_t blocks[SCHED_MAX_OPS * JBOD_BLOCK_SIZE];
+  int slots[SCHED_QUEUE_DEPTH];
+  if (queue_len == 0){
+    return 0;
+  }
+  // sweeps the array once, starting at the head and wrapping around; the
+  // positions leave a gap after each disk unless its number of blocks is a
+  // power of two, which keeps them a shift apart and does not change the order
+  uint32_t total = (uint32_t)geometry.num_disks << geometry.block_shift;
+  uint32_t head = 0;
+  if (head_disk != -1){
+    head = ((uint32_t)head_disk << geometry.block_shift) | (head_block == -1 ? 0 : head_block);
+  }
+  for (int i = 0; i < queue_len; i++){
+    uint32_t at = ((uint32_t)queue[i].disk_num << geometry.block_shift) | queue[i].block_num;
+    queue[i].pos = at >= head ? at - head : at + total - head;
+  }
+  qsort(queue, queue_len, sizeof(sched_op_t), compare_ops);
+  // seeks only where an operation does not follow the previous one
+  int n = 0;
+  int disk_num = head_disk, block_num = head_block;
+  for (int i = 0; i < queue_len; i++){
+    sched_op_t *op = &queue[i];
+    if (op->disk_num != disk_num){
+      ops[n++] = geom_encode_op(JBOD_SEEK_TO_DISK, op->disk_num, 0);
+      disk_num = op->disk_num;
+      block_num = -1;
+      num_seeks++;
+    }
+    if (op->block_num != block_num){
+      ops[n++] = geom_encode_op(JBOD_SEEK_TO_BLOCK, 0, op->block_num);
+      block_num = op->block_num;
+      num_seeks++;
+      num_runs++;
+    }
+    if (op->cmd == JBOD_WRITE_BLOCK){
+      memcpy(&blocks[n * JBOD_BLOCK_SIZE], op->block, JBOD_BLOCK_SIZE);
+    }
+    slots[i] = n;
+    ops[n++] = geom_encode_op(op->cmd, 0, 0);
+    // the server advances to the next block after every read or write
+    block_num++;
+    if (block_num == geometry.blocks_per_disk){
+      block_num = -1;
+    }
+  }
+  num_ops += queue_len;
+  uint64_t start = clock_ns();
+  int result = jbod_client_operations(n, ops, blocks);
+  server_ns += clock_ns() - start;
+  if (result == -1){
+    head_disk = -1;
+    head_block = -1;
+  } else {
+    head_disk = disk_num;
+    head_block = block_num;
+    for (int i = 0; i < queue_len; i++){
+      if (queue[i].cmd == JBOD_READ_BLOCK){
+	memcpy(queue[i].block, &blocks[slots[i] * JBOD_BLOCK_SIZE], JBOD_BLOCK_SIZE);
+      }
+    }
+  }
+  queue_len = 0;
+  return result;
+}
+
+void sched_reset_head(void) {
+  head_disk = -1;
+  head_block = -1;
+}
+
+void sched_print_stats(void) {
+  fprintf(stderr, "scheduled ops: %d in %d runs, seeks: %d (%.3f per KB), %.1f us per op at the server\n",
+	  num_ops, num_runs, num_seeks, num_ops ? (float) num_seeks * 1024 / ((float) num_ops * JBOD_BLOCK_SIZE) : 0,
+	  num_ops ? server_ns / 1000.0 / num_ops : 0);
+}
@@ -0,0 +1,43 @@
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include <stdint.h>
+
+#include "jbod.h"
+
+/* the most block operations queued before the scheduler flushes by itself */
+#define SCHED_QUEUE_DEPTH 256
+
+typedef struct {
+  jbod_cmd_t cmd;       /* JBOD_READ_BLOCK or JBOD_WRITE_BLOCK */
+  int disk_num;
+  int block_num;
+  uint8_t *block;       /* where a read lands or what a write stores */
+  int seq;              /* arrival order, kept among operations on one block */
+  uint32_t pos;         /* distance from the head, the elevator order */
+} sched_op_t;
+
+/* Returns 0 on success and -1 on failure. Queues a read of the block at
+ * |disk_num| and |block_num| into |block|, which is filled in by the next
+ * sched_flush. */
+int sched_read(int disk_num, int block_num, uint8_t *block);
+
+/* Returns 0 on success and -1 on failure. Queues a write of |block| to the
+ * block at |disk_num| and |block_num|; |block| must stay unchanged until
+ * the next sched_flush. */
+int sched_write(int disk_num, int block_num, const uint8_t *block);
+
+/* Returns 0 on success and -1 if any operation failed. Sends the queued
+ * operations in one elevator sweep from the current head position,
+ * ordered by (disk, block) with operations on the same block kept in
+ * arrival order. Operations on consecutive blocks become one seek followed
+ * by a run of reads and writes, and the runs are pipelined. */
+int sched_flush(void);
+
+/* Forgets the head position, e.g. after mounting. */
+void sched_reset_head(void);
+
+/* Prints the operation, run and seek counts. */
+void sched_print_stats(void);
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jbod.h"
+#include "snap.h"
+
+/* the generations of the snapshots alive, in increasing order */
+static int live[SNAP_MAX_SNAPSHOTS];
+static int num_live = 0;
+static int next_gen = 1;
+
+/* the preserved versions of every logical block, oldest first, and the
+ * generation of the newest one (0 if none) */
+static snap_version_t **versions = NULL;
+static uint32_t *preserved_gen = NULL;
+static uint32_t num_blocks = 0;
+
+/* counters reported by snap_print_stats */
+static int num_preserved = 0;
+static int peak_preserved = 0;
+static int num_freed = 0;
+
+int snap_create(uint32_t new_num_blocks) {
+  if (num_live == SNAP_MAX_SNAPSHOTS || (versions != NULL && new_num_blocks != num_blocks)){
+    return -1;
+  }
+  if (versions == NULL){
+    versions = calloc(new_num_blocks, sizeof(snap_version_t *));
+    preserved_gen = calloc(new_num_blocks, sizeof(uint32_t));
+    if (versions == NULL || preserved_gen == NULL){
+      snap_reset();
+      return -1;
+    }
+    num_blocks = new_num_blocks;
+  }
+  live[num_live++] = next_gen;
+  return next_gen++;
+}
+
+bool snap_exists(int gen) {
+  for (int i = 0; i < num_live; i++){
+    if (live[i] == gen){
+      return true;
+    }
+  }
+  return false;
+}
+
+/* returns whether a snapshot alive lies in the generations (low, high] */
+static bool live_between(uint32_t low, uint32_t high) {
+  for (int i = 0; i < num_live; i++){
+    if ((uint32_t)live[i] > low && (uint32_t)live[i] <= high){
+      return true;
+    }
+  }
+  return false;
+}
+
+int snap_release(int gen) {
+  int i = 0;
+  while (i < num_live && live[i] != gen){
+    i++;
+  }
+  if (i == num_live){
+    return -1;
+  }
+  memmove(&live[i], &live[i + 1], (num_live - i - 1) * sizeof(int));
+  num_live--;
+  // a version serves the snapshots taken after the version before it was
+  // preserved, and can go once none of them is alive
+  for (uint32_t b = 0; b < num_blocks; b++){
+    snap_version_t **link = &versions[b];
+    uint32_t low = 0;
+    preserved_gen[b] = 0;
+    while (*link != NULL){
+      snap_version_t *v = *link;
+      if (live_between(low, v->gen)){
+	low = v->gen;
+	preserved_gen[b] = v->gen;
+	link = &v->next;
+      } else {
+	*link = v->next;
+	free(v);
+	num_preserved--;
+	num_freed++;
+      }
+    }
+  }
+  return 1;
+}
+
+bool snap_needs_copy(uint32_t lblock) {
+  return num_live > 0 && lblock < num_blocks && preserved_gen[lblock] < (uint32_t)live[num_live - 1];
+}
+
+int snap_preserve(uint32_t lblock, const uint8_t *block) {
+  if (!snap_needs_copy(lblock)){
+    return 0;
+  }
+  snap_version_t *v = malloc(sizeof(snap_version_t));
+  if (v == NULL){
+    return -1;
+  }
+  // the newest snapshot is newer than every version already kept
+  v->gen = live[num_live - 1];
+  v->next = NULL;
+  memcpy(v->block, block, JBOD_BLOCK_SIZE);
+  snap_version_t **link = &versions[lblock];
+  while (*link != NULL){
+    link = &(*link)->next;
+  }
+  *link = v;
+  preserved_gen[lblock] = v->gen;
+  num_preserved++;
+  if (num_preserved > peak_preserved){
+    peak_preserved = num_preserved;
+  }
+  return 0;
+}
+
+bool snap_lookup(int gen, uint32_t lblock, uint8_t *buf) {
+  if (lblock >= num_blocks){
+    return false;
+  }
+  // the oldest version preserved at or after the snapshot holds what the
+  // block contained when it was taken
+  for (snap_version_t *v = versions[lblock]; v != NULL; v = v->next){
+    if (v->gen >= (uint32_t)gen){
+      memcpy(buf, v->block, JBOD_BLOCK_SIZE);
+      return true;
+    }
+  }
+  return false;
+}
+
+void snap_reset(void) {
+  for (uint32_t b = 0; versions != NULL && b < num_blocks; b++){
+    while (versions[b] != NULL){
+      snap_version_t *v = versions[b];
+      versions[b] = v->next;
+      free(v);
+    }
+  }
+  free(versions);
+  free(preserved_gen);
+  versions = NULL;
+  preserved_gen = NULL;
+  num_blocks = 0;
+  num_live = 0;
+  num_preserved = 0;
+}
+
+void snap_print_stats(void) {
+  if (next_gen == 1){
+    return;
+  }
+  fprintf(stderr, "snapshots: %d taken, %d alive, preserved blocks: %d (peak %d, %d freed)\n",
+	  next_gen - 1, num_live, num_preserved, peak_preserved, num_freed);
+}
@@ -0,0 +1,52 @@
+#ifndef SNAP_H_
+#define SNAP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "jbod.h"
+
+/* the most snapshots alive at once */
+#define SNAP_MAX_SNAPSHOTS 64
+
+/* the contents a logical block had before the first write after snapshot
+ * |gen|; it also stands for every older snapshot taken after the previous
+ * version of the block was preserved */
+typedef struct snap_version {
+  uint32_t gen;
+  struct snap_version *next;    /* the next newer version of the block */
+  uint8_t block[JBOD_BLOCK_SIZE];
+} snap_version_t;
+
+/* Returns the generation of a new snapshot of an array of |num_blocks|
+ * logical blocks, or -1 on failure. Generations start at 1 and grow with
+ * every snapshot; every snapshot alive must cover the same |num_blocks|. */
+int snap_create(uint32_t num_blocks);
+
+/* Returns 1 on success and -1 on failure. Forgets snapshot |gen| and frees
+ * the preserved blocks no other snapshot resolves to. */
+int snap_release(int gen);
+
+/* Returns true if snapshot |gen| exists. */
+bool snap_exists(int gen);
+
+/* Returns true if the contents of logical block |lblock| have to be
+ * preserved with snap_preserve before it is overwritten, i.e. it was not
+ * written since the newest snapshot was taken. */
+bool snap_needs_copy(uint32_t lblock);
+
+/* Returns 0 on success and -1 on failure. Keeps |block|, the contents of
+ * |lblock| about to be overwritten, for the snapshots that still see it. */
+int snap_preserve(uint32_t lblock, const uint8_t *block);
+
+/* Returns true and copies the block to |buf| if snapshot |gen| sees
+ * preserved contents for |lblock|; false means it sees the live block. */
+bool snap_lookup(int gen, uint32_t lblock, uint8_t *buf);
+
+/* Frees every snapshot and preserved block, e.g. when the layout changes. */
+void snap_reset(void);
+
+/* Prints the number of snapshots and preserved blocks. */
+void snap_print_stats(void);
+
+#endif
@@ -12,25 +12,56 @@
 #include <assert.h>
 
 #include "cache.h"
+#include "geometry.h"
 #include "jbod.h"
 #include "mdadm.h"
 #include "util.h"
 #include "tester.h"
 #include "net.h"
+#include "sched.h"
+#include "snap.h"
+#include "vcache.h"
 
-#define TESTER_ARGUMENTS "hw:s:"
+#define TESTER_ARGUMENTS "hw:s:u:r:p:zg:v:f:q:"
 #define USAGE                                               \
-  "USAGE: test [-h] [-w workload-file] [-s cache_size] \n"  \
+  "USAGE: test [-h] [-w workload-file] [-s cache_size] [-u stripe_blocks] [-r stripe_blocks] [-p port] [-z] [-g disks,blocks] [-v victim_blocks [-f victim_file]] [-q depth] \n"  \
   "\n"                                                      \
   "where:\n"                                                \
   "    -h - help mode (display this message)\n"             \
+  "    -u - stripe the array in units of stripe_blocks\n"   \
+  "    -r - use RAID-5 in units of stripe_blocks\n"         \
+  "    -p - connect to the server (or a jbod_relay) on port\n" \
+  "    -z - ask the server for compressed frames\n"         \
+  "    -g - use disks disks of blocks blocks each\n"       \
+  "    -v - keep victim_blocks blocks evicted from the cache in a file\n" \
+  "    -f - the victim cache file (default: an unlinked temporary file)\n" \
+  "    -q - submit up to depth consecutive reads and writes together\n" \
   "\n"                                                      \
 
 int run_workload(char *workload, int cache_size);
 
+/* the second cache tier, created with the cache */
+static int victim_size = 0;
+static char *victim_path = NULL;
+
+/* consecutive READ and WRITE lines wait here until |queue_depth| of them
+ * are submitted together, or until a line of another kind comes */
+#define MAX_QUEUE_DEPTH 256
+static int queue_depth = 1;
+static int num_queued = 0;
+static mdadm_request_t queued[MAX_QUEUE_DEPTH];
+static uint8_t queued_bufs[MAX_QUEUE_DEPTH][MAX_IO_SIZE];
+
+/* the most blocks SIGNALL signs in one pipelined run */
+#define SIGN_RUN 256
+
 int main(int argc, char *argv[])
 {
-  int ch, cache_size = 0;
+  int ch, cache_size = 0, port = JBOD_PORT;
+  int num_disks = JBOD_NUM_DISKS, blocks_per_disk = JBOD_NUM_BLOCKS_PER_DISK;
+  mdadm_layout_t layout = MDADM_LINEAR;
+  char *stripe_blocks = "1";
+  bool compress = false;
   char *workload = NULL;
 
   while ((ch = getopt(argc, argv, TESTER_ARGUMENTS)) != -1) {
@@ -44,6 +75,39 @@ int main(int argc, char *argv[])
       case 'w':
         workload = optarg;
         break;
+      case 'u':
+        layout = MDADM_STRIPED;
+        stripe_blocks = optarg;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'z':
+        compress = true;
+        break;
+      case 'r':
+        layout = MDADM_RAID5;
+        stripe_blocks = optarg;
+        break;
+      case 'v':
+        victim_size = atoi(optarg);
+        break;
+      case 'f':
+        victim_path = optarg;
+        break;
+      case 'g':
+        if (sscanf(optarg, "%d,%d", &num_disks, &blocks_per_disk) != 2) {
+          fprintf(stderr, "Invalid geometry %s, aborting.\n", optarg);
+          return -1;
+        }
+        break;
+      case 'q':
+        queue_depth = atoi(optarg);
+        if (queue_depth < 1 || queue_depth > MAX_QUEUE_DEPTH) {
+          fprintf(stderr, "Invalid queue depth %s, aborting.\n", optarg);
+          return -1;
+        }
+        break;
       default:
         fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
         return -1;
@@ -55,8 +119,25 @@ int main(int argc, char *argv[])
     return -1;
   }
 
-  if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
+  if (victim_size && !cache_size) {
+    fprintf(stderr, "The victim cache needs a cache (-s), aborting.\n");
+    return -1;
+  }
+
+  // the layout is checked against the geometry, so the geometry goes first
+  if (mdadm_set_geometry(num_disks, blocks_per_disk) != 1) {
+    fprintf(stderr, "Invalid geometry %d,%d, aborting.\n", num_disks, blocks_per_disk);
+    return -1;
+  }
+  if (mdadm_set_layout(layout, atoi(stripe_blocks)) != 1) {
+    fprintf(stderr, "Invalid stripe unit %s, aborting.\n", stripe_blocks);
+    return -1;
+  }
+
+  if (!jbod_connect(JBOD_SERVER, port))
     return -1;
+  if (compress && !jbod_negotiate_compression())
+    fprintf(stderr, "Server does not support compression, continuing without.\n");
   
   run_workload(workload, cache_size);
   jbod_disconnect();
@@ -70,24 +151,24 @@ int equals(const char *s1, const char *s2) {
 
 static uint32_t encode_op(jbod_cmd_t cmd, int disk_num, int block_num) {
   assert(cmd >= 0 && cmd < JBOD_NUM_CMDS);
-  assert(block_num >= 0 && block_num < JBOD_NUM_BLOCKS_PER_DISK);
+  assert(block_num >= 0 && block_num < geometry.blocks_per_disk);
 
-  uint32_t op = 0;
-  op |= cmd << 12;
-  op |= disk_num << 8;
-  op |= block_num;
+  return geom_encode_op(cmd, disk_num, block_num);
+}
 
-  return op;
+static void submit_queued(void) {
+  if (num_queued > 0) {
+    mdadm_submit(num_queued, queued);
+    num_queued = 0;
+  }
 }
 
 int run_workload(char *workload, int cache_size) {
   char line[256], cmd[32];
-  uint8_t buf[MAX_IO_SIZE];
   uint32_t addr, len, ch;
+  int disk_num, gen;
   int rc;
 
-  memset(buf, 0, MAX_IO_SIZE);
-
   FILE *f = fopen(workload, "r");
   if (!f)
     err(1, "Cannot open workload file %s", workload);
@@ -96,46 +177,110 @@ int run_workload(char *workload, int cache_size) {
     rc = cache_create(cache_size);
     if (rc != 1)
       errx(1, "Failed to create cache.");
+    if (victim_size && vcache_create(victim_path, victim_size) != 1)
+      errx(1, "Failed to create victim cache.");
   }
 
   int line_num = 0;
   while (fgets(line, 256, f)) {
     ++line_num;
     line[strlen(line)-1] = '\0';
+    // the queued requests come first in the trace; match the whole
+    // command word so WRITE_PERMIT and friends flush the queue too
+    if (strncmp(line, "READ ", 5) != 0 && strncmp(line, "WRITE ", 6) != 0)
+      submit_queued();
     if (equals(line, "MOUNT")) {
       rc = mdadm_mount();
+      if (rc != 1)
+        errx(1, "Failed to mount the array on line %d, aborting.", line_num);
     } else if (equals(line, "UNMOUNT")) {
       rc = mdadm_unmount();
     } else if (equals(line, "WRITE_PERMIT")) {
       rc = mdadm_write_permission();
     } else if (equals(line, "WRITE_PERMIT_REVOKE")) {
       rc = mdadm_revoke_write_permission();
+    } else if (equals(line, "RESYNC")) {
+      rc = mdadm_resync();
+    } else if (equals(line, "REBUILD")) {
+      rc = mdadm_rebuild();
+    } else if (equals(line, "FAIL_DISK")) {
+      if (sscanf(line, "FAIL_DISK %d", &disk_num) != 1)
+        errx(1, "Failed to parse command: [%s\n], aborting.", line);
+      rc = mdadm_fail_disk(disk_num);
+    } else if (equals(line, "SNAPSHOT_RELEASE")) {
+      if (sscanf(line, "SNAPSHOT_RELEASE %d", &gen) != 1)
+        errx(1, "Failed to parse command: [%s\n], aborting.", line);
+      rc = mdadm_snapshot_release(gen);
+    } else if (equals(line, "SNAPSHOT_SIGN")) {
+      if (sscanf(line, "SNAPSHOT_SIGN %d", &gen) != 1)
+        errx(1, "Failed to parse command: [%s\n], aborting.", line);
+      // signs each block of the array as snapshot |gen| sees it, reading
+      // SIGN_RUN blocks at a time
+      uint32_t num_blocks = mdadm_capacity() / JBOD_BLOCK_SIZE;
+      for (uint32_t first = 0; first < num_blocks; first += SIGN_RUN) {
+        static uint8_t b[SIGN_RUN * JBOD_BLOCK_SIZE];
+        uint32_t count = num_blocks - first;
+        if (count > SIGN_RUN)
+          count = SIGN_RUN;
+        if (mdadm_snapshot_read(gen, first * JBOD_BLOCK_SIZE, count * JBOD_BLOCK_SIZE, b) == -1)
+          errx(1, "Failed to read snapshot %d on line %d, aborting.", gen, line_num);
+        for (uint32_t j = 0; j < count; ++j)
+          fprintf(stdout, "SNAP(gen,block) %2d %5u : %s\n", gen, first + j,
+                  sha1_sig(&b[j * JBOD_BLOCK_SIZE], JBOD_BLOCK_SIZE));
+      }
+    } else if (equals(line, "SNAPSHOT")) {
+      rc = mdadm_snapshot_create();
+    } else if (equals(line, "SCRUB_DIRTY")) {
+      rc = mdadm_scrub(true);
+      fprintf(stdout, "SCRUB_DIRTY: %d mismatches\n", rc);
+    } else if (equals(line, "SCRUB")) {
+      rc = mdadm_scrub(false);
+      fprintf(stdout, "SCRUB: %d mismatches\n", rc);
     } else if (equals(line, "SIGNALL")) {
-      for (int i = 0; i < JBOD_NUM_DISKS; ++i)
-        for (int j = 0; j < JBOD_NUM_BLOCKS_PER_DISK; ++j) {
-          uint8_t b[JBOD_BLOCK_SIZE];
-          jbod_client_operation(encode_op(JBOD_SIGN_BLOCK, i, j), b);
-          fprintf(stdout, "%s", b);
+      // signs each disk with pipelined runs of up to SIGN_RUN requests
+      for (int i = 0; i < geometry.num_disks; ++i) {
+        for (int first = 0; first < geometry.blocks_per_disk; first += SIGN_RUN) {
+          uint32_t ops[SIGN_RUN];
+          static uint8_t b[SIGN_RUN * JBOD_BLOCK_SIZE];
+          int count = geometry.blocks_per_disk - first;
+          if (count > SIGN_RUN)
+            count = SIGN_RUN;
+          for (int j = 0; j < count; ++j)
+            ops[j] = encode_op(JBOD_SIGN_BLOCK, i, first + j);
+          jbod_client_operations(count, ops, b);
+          for (int j = 0; j < count; ++j)
+            fprintf(stdout, "%s", &b[j * JBOD_BLOCK_SIZE]);
         }
+      }
     } else {
       if (sscanf(line, "%7s %7u %4u %3u", cmd, &addr, &len, &ch) != 4)
         errx(1, "Failed to parse command: [%s\n], aborting.", line);
-      if (equals(cmd, "READ")) {
-        rc = mdadm_read(addr, len, buf);
-      } else if (equals(cmd, "WRITE")) {
-        memset(buf, ch, len);
-        rc = mdadm_write(addr, len, buf);
-      } else {
+      if (!equals(cmd, "READ") && !equals(cmd, "WRITE"))
         errx(1, "Unknown command [%s] on line %d, aborting.", line, line_num);
-      }
+      if (len > MAX_IO_SIZE)
+        errx(1, "Request longer than %d bytes on line %d, aborting.", MAX_IO_SIZE, line_num);
+      mdadm_request_t *req = &queued[num_queued];
+      req->write = equals(cmd, "WRITE");
+      req->addr = addr;
+      req->len = len;
+      req->buf = queued_bufs[num_queued];
+      if (req->write)
+        memset(req->buf, ch, len);
+      if (++num_queued == queue_depth)
+        submit_queued();
     }
   }
+  submit_queued();
   fclose(f);
 
   if (cache_size)
     cache_destroy();
 
   cache_print_hit_rate();
+  mdadm_print_stats();
+  sched_print_stats();
+  snap_print_stats();
+  jbod_print_frame_stats();
 
   return 0;
 }
@@ -0,0 +1,66 @@
+#!/bin/sh
+# Replays each trace with the tester options it was recorded for, every
+# time against a freshly started JBOD server, and compares what the tester
+# prints with the trace's expected output. Run it from the top of the tree
+# after make (or through make check); SERVER names the server to start and
+# defaults to ./jbod_server.
+
+SERVER=${SERVER:-./jbod_server}
+failed=0
+
+# replay trace [relay] options...: a trace marked relay reaches the server
+# through jbod_relay, which only speaks compressed frames, so its options
+# include -z
+replay() {
+  trace=$1
+  shift
+  relay=
+  if [ "$1" = relay ]; then
+    relay=1
+    shift
+  fi
+  $SERVER > /dev/null 2>&1 &
+  server_pid=$!
+  sleep 0.5
+  port=
+  if [ -n "$relay" ]; then
+    ./jbod_relay > /dev/null 2>&1 &
+    relay_pid=$!
+    sleep 0.5
+    port="-p 3334"
+  fi
+  if ./tester -w traces/$trace-input $port "$@" 2> /dev/null | cmp -s - traces/$trace-expected-output; then
+    echo "ok   $trace ${relay:+relay }$*"
+  else
+    echo "FAIL $trace ${relay:+relay }$*"
+    failed=1
+  fi
+  if [ -n "$relay" ]; then
+    kill $relay_pid 2> /dev/null
+    wait $relay_pid 2> /dev/null
+  fi
+  kill $server_pid 2> /dev/null
+  wait $server_pid 2> /dev/null
+}
+
+# the original traces; neither the caches, the queue depth nor the relay
+# may change what they print
+replay simple -s 1024
+replay linear -s 1024
+replay random -s 1024
+replay random -s 1024 -v 2048
+replay random -s 1024 -q 32
+replay linear relay -s 1024 -z
+
+# the layouts and the features that print their own output
+replay striped -u 4 -s 256
+replay striped -u 4 -s 256 -q 16
+replay raid5-rebuild -r 1 -s 16
+replay scrub -r 2 -s 64
+replay snapshot -u 2 -s 64
+replay snapshot -u 2 -s 64 -q 8
+
+# a queued WRITE must not run under a WRITE_PERMIT that comes after it
+replay permit-queue -q 4
+
+exit $failed
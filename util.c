@@ -4,8 +4,13 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <assert.h>
+#include <string.h>
+#include <time.h>
 #include <openssl/sha.h>
 #include <openssl/rand.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "util.h"
 
@@ -34,12 +39,17 @@ void debug_log(const char *fmt, ...) {
 }
 
 const char *sha1_sig(uint8_t *buf, uint32_t size) {
-  static char sig[80];
+  static char sig[SHA1_SIG_LEN];
+
+  return sha1_sig_r(buf, size, sig);
+}
+
+const char *sha1_sig_r(const uint8_t *buf, uint32_t size, char *sig) {
   uint8_t obuf[20];
 
   SHA1(buf, size, obuf);
   for (int i = 0; i < 15; ++i) {
-    char *p = (char *)sig + i * 5;
+    char *p = sig + i * 5;
     sprintf(p, "0x%02x ", obuf[i]);
   }
   return sig;
@@ -55,3 +65,110 @@ uint32_t get_rand(uint32_t min, uint32_t max) {
     v = max;
   return v;
 }
+
+#if defined(__x86_64__)
+/* XORs 32 bytes at a time while at least 32 are left and returns how many
+ * bytes it did */
+__attribute__((target("avx2")))
+static uint32_t xor_block_avx2(uint8_t *dst, const uint8_t *src, uint32_t len) {
+  uint32_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(a, b));
+  }
+  return i;
+}
+#endif
+
+void xor_block(uint8_t *dst, const uint8_t *src, uint32_t len) {
+  uint32_t i = 0;
+  // uses AVX2 when the CPU has it and SSE2, which every x86-64 CPU has,
+  // for what is left, then 8 and 1 bytes at a time
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2"))
+    i = xor_block_avx2(dst, src, len);
+  for (; i + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, b));
+  }
+#endif
+  for (; i + 8 <= len; i += 8) {
+    uint64_t a, b;
+    memcpy(&a, dst + i, 8);
+    memcpy(&b, src + i, 8);
+    a ^= b;
+    memcpy(dst + i, &a, 8);
+  }
+  for (; i < len; ++i)
+    dst[i] ^= src[i];
+}
+
+int block_is_fill(const uint8_t *buf, uint32_t len, uint8_t *fill) {
+  uint32_t i = 0;
+  if (len == 0)
+    return 0;
+  // compares 8 bytes at a time against the first byte repeated
+  uint64_t pattern = buf[0] * 0x0101010101010101ULL;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t v;
+    memcpy(&v, buf + i, 8);
+    if (v != pattern)
+      return 0;
+  }
+  for (; i < len; ++i)
+    if (buf[i] != buf[0])
+      return 0;
+  *fill = buf[0];
+  return 1;
+}
+
+/* reflected CRC32C polynomial, filled into the lookup table on first use */
+#define CRC32C_POLY 0x82f63b78
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, uint32_t len) {
+  if (crc32c_table[1] == 0) {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k)
+        c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+      crc32c_table[i] = c;
+    }
+  }
+  for (uint32_t i = 0; i < len; ++i)
+    crc = crc32c_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+/* the SSE4.2 crc32 instruction computes CRC32C 8 bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, uint32_t len) {
+  uint64_t c = crc;
+  for (; len >= 8; len -= 8, buf += 8) {
+    uint64_t v;
+    memcpy(&v, buf, 8);
+    c = _mm_crc32_u64(c, v);
+  }
+  crc = (uint32_t)c;
+  for (; len > 0; --len)
+    crc = _mm_crc32_u8(crc, *buf++);
+  return crc;
+}
+#endif
+
+uint32_t crc32c(const uint8_t *buf, uint32_t len) {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2"))
+    return ~crc32c_hw(~0u, buf, len);
+#endif
+  return ~crc32c_sw(~0u, buf, len);
+}
+
+uint64_t clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -3,11 +3,29 @@
 
 #include <stdint.h>
 
+#define SHA1_SIG_LEN 80
+
 void enable_debug_log(void);
 void set_debug_logfile(const char *filename);
 void debug_log(const char *fmt, ...);
 
 const char *sha1_sig(uint8_t *buf, uint32_t size);
+/* Like sha1_sig, but writes the signature to |sig|, which must hold
+ * SHA1_SIG_LEN bytes, so it can be used from several threads at once. */
+const char *sha1_sig_r(const uint8_t *buf, uint32_t size, char *sig);
 uint32_t get_rand(uint32_t min, uint32_t max);
 
+/* XORs |len| bytes of |src| into |dst|. */
+void xor_block(uint8_t *dst, const uint8_t *src, uint32_t len);
+
+/* Returns 1 if all |len| bytes of |buf| are equal, storing that byte in
+ * |fill|, and 0 otherwise. */
+int block_is_fill(const uint8_t *buf, uint32_t len, uint8_t *fill);
+
+/* Returns the CRC32C (Castagnoli) checksum of |len| bytes of |buf|. */
+uint32_t crc32c(const uint8_t *buf, uint32_t len);
+
+/* Returns a monotonic time in nanoseconds, for measuring latencies. */
+uint64_t clock_ns(void);
+
 #endif
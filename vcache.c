@@ -0,0 +1,170 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "geometry.h"
+#include "jbod.h"
+#include "util.h"
+#include "vcache.h"
+
+static int fd = -1;
+static vcache_slot_t *slots = NULL;
+static int num_slots = 0;
+static int hand = 0;
+
+/* the slot of every block of the array, or -1; indexed like the geometry
+ * lays out op numbers, disk above block */
+static int *slot_of = NULL;
+
+/* counters reported by vcache_print_stats */
+static int num_queries = 0;
+static int num_hits = 0;
+static int num_puts = 0;
+static int num_kept = 0;
+static int num_evictions = 0;
+static int num_io_errors = 0;
+static uint64_t hit_ns = 0;
+
+static uint32_t block_key(int disk_num, int block_num) {
+  return ((uint32_t)disk_num << geometry.block_shift) | block_num;
+}
+
+int vcache_create(const char *path, int num_blocks) {
+  if (vcache_enabled() || num_blocks < 1 || num_blocks > (int)geometry.num_blocks){
+    return -1;
+  }
+  if (path != NULL){
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  } else {
+    // the blocks only matter while the array is mounted, so nothing needs
+    // to find the file again
+    char tmp[] = "/tmp/mdadm-vcache-XXXXXX";
+    fd = mkstemp(tmp);
+    if (fd != -1){
+      unlink(tmp);
+    }
+  }
+  if (fd == -1){
+    return -1;
+  }
+  // reserves the space up front, so a full disk shows now and not as
+  // failed writes later
+  off_t size = (off_t)num_blocks * JBOD_BLOCK_SIZE;
+  size_t num_keys = (size_t)geometry.num_disks << geometry.block_shift;
+  slots = calloc(num_blocks, sizeof(vcache_slot_t));
+  slot_of = malloc(num_keys * sizeof(int));
+  if (posix_fallocate(fd, 0, size) != 0 || slots == NULL || slot_of == NULL){
+    vcache_destroy();
+    return -1;
+  }
+  for (size_t i = 0; i < num_keys; i++){
+    slot_of[i] = -1;
+  }
+  num_slots = num_blocks;
+  hand = 0;
+  return 1;
+}
+
+int vcache_destroy(void) {
+  if (fd == -1){
+    return -1;
+  }
+  close(fd);
+  free(slots);
+  free(slot_of);
+  fd = -1;
+  slots = NULL;
+  slot_of = NULL;
+  num_slots = 0;
+  return 1;
+}
+
+bool vcache_enabled(void) {
+  return fd != -1 && num_slots > 0;
+}
+
+static void free_slot(int pos) {
+  slot_of[block_key(slots[pos].disk_num, slots[pos].block_num)] = -1;
+  slots[pos].valid = false;
+}
+
+void vcache_put(int disk_num, int block_num, const uint8_t *buf) {
+  if (!vcache_enabled()){
+    return;
+  }
+  uint32_t key = block_key(disk_num, block_num);
+  if (slot_of[key] != -1){
+    // the copy from before the promotion is still current
+    num_kept++;
+    return;
+  }
+  // the hand passes over referenced slots once, clearing their bit, and
+  // takes the first slot that is free or was not used since
+  while (slots[hand].valid && slots[hand].referenced){
+    slots[hand].referenced = false;
+    hand = (hand + 1) % num_slots;
+  }
+  int pos = hand;
+  hand = (hand + 1) % num_slots;
+  if (slots[pos].valid){
+    free_slot(pos);
+    num_evictions++;
+  }
+  num_puts++;
+  if (pwrite(fd, buf, JBOD_BLOCK_SIZE, (off_t)pos * JBOD_BLOCK_SIZE) != JBOD_BLOCK_SIZE){
+    num_io_errors++;
+    return;
+  }
+  slots[pos].valid = true;
+  slots[pos].referenced = true;
+  slots[pos].disk_num = disk_num;
+  slots[pos].block_num = block_num;
+  slot_of[key] = pos;
+}
+
+int vcache_lookup(int disk_num, int block_num, uint8_t *buf) {
+  if (!vcache_enabled()){
+    return -1;
+  }
+  num_queries++;
+  int pos = slot_of[block_key(disk_num, block_num)];
+  if (pos == -1){
+    return -1;
+  }
+  uint64_t start = clock_ns();
+  if (pread(fd, buf, JBOD_BLOCK_SIZE, (off_t)pos * JBOD_BLOCK_SIZE) != JBOD_BLOCK_SIZE){
+    num_io_errors++;
+    free_slot(pos);
+    return -1;
+  }
+  hit_ns += clock_ns() - start;
+  slots[pos].referenced = true;
+  num_hits++;
+  return 1;
+}
+
+void vcache_drop(int disk_num, int block_num) {
+  if (!vcache_enabled()){
+    return;
+  }
+  int pos = slot_of[block_key(disk_num, block_num)];
+  if (pos != -1){
+    free_slot(pos);
+  }
+}
+
+void vcache_print_stats(void) {
+  if (num_queries == 0 && num_puts == 0){
+    return;
+  }
+  fprintf(stderr, "victim cache: %d hits of %d L1 misses (%5.1f%%), %.1f us per hit, %d stored, %d still held, %d evicted",
+	  num_hits, num_queries, num_queries ? 100 * (float) num_hits / num_queries : 0,
+	  num_hits ? hit_ns / 1000.0 / num_hits : 0, num_puts, num_kept, num_evictions);
+  if (num_io_errors > 0){
+    fprintf(stderr, ", %d I/O errors", num_io_errors);
+  }
+  fprintf(stderr, "\n");
+}
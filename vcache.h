@@ -0,0 +1,51 @@
+#ifndef VCACHE_H_
+#define VCACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "jbod.h"
+
+/* a block slot of the victim cache file */
+typedef struct {
+  bool valid;
+  bool referenced;      /* stored or hit since the clock hand last passed */
+  int disk_num;
+  int block_num;
+} vcache_slot_t;
+
+/* Returns 1 on success and -1 on failure. Creates the second cache tier:
+ * |num_blocks| blocks in a file at |path|, preallocated, or in an unlinked
+ * temporary file if |path| is NULL. It holds the blocks the in-memory cache
+ * evicts; a block promoted back keeps its copy here for as long as its
+ * contents do not change. */
+int vcache_create(const char *path, int num_blocks);
+
+/* Returns 1 on success and -1 on failure. Closes the file; one given by
+ * path is left in place. */
+int vcache_destroy(void);
+
+/* Returns true if the victim cache is enabled. */
+bool vcache_enabled(void);
+
+/* Stores the block at |disk_num| and |block_num| evicted from the
+ * in-memory cache, replacing an older victim by the clock (second chance)
+ * policy if the file is full: the hand skips, once, the blocks stored or
+ * hit since it last passed. A block that still has its copy here is not written
+ * again, since vcache_drop removes any copy whose contents change. */
+void vcache_put(int disk_num, int block_num, const uint8_t *buf);
+
+/* Returns 1 and copies the block to |buf| if the victim cache holds the
+ * block at |disk_num| and |block_num|, and -1 otherwise. The block keeps
+ * its copy and is marked as referenced, which spares it the next time the
+ * clock hand passes. */
+int vcache_lookup(int disk_num, int block_num, uint8_t *buf);
+
+/* Forgets the block at |disk_num| and |block_num|, e.g. because its
+ * contents changed in the in-memory cache. */
+void vcache_drop(int disk_num, int block_num);
+
+/* Prints the hit rate and latency of the victim cache. */
+void vcache_print_stats(void);
+
+#endif